@@ -0,0 +1,289 @@
+/*
+ * clox-bench runs Lox benchmark programs inside its own VM, each a number of
+ * times, and reports the median and 95th percentile wall time, the
+ * instructions executed and the peak heap of each. Isolates a program joins
+ * count toward both: their instructions are added to the program's, and so
+ * are their peak heaps, which makes the heap figure an upper bound for
+ * programs whose isolates overlap. Results can be saved as JSON and later
+ * compared against:
+ *
+ *   clox-bench --save base.json
+ *   clox-bench --baseline base.json --max-regression 5
+ *
+ * With no programs named it runs every .lox file in the bench directory.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcstats.h"
+#include "isolate.h"
+#include "marker.h"
+#include "vm.h"
+
+#ifndef CLOX_BENCH_DIR
+#define CLOX_BENCH_DIR "bench"
+#endif
+
+#define BENCHMARKS_MAX 256
+#define BENCH_NAME_MAX 64
+
+typedef struct {
+    char name[BENCH_NAME_MAX];
+    double median;
+    double p95;
+    unsigned long instructions;
+    size_t peakHeap;
+} Result;
+
+typedef struct {
+    Result results[BENCHMARKS_MAX];
+    int count;
+} Results;
+
+static void usage() {
+    fprintf(stderr, "Usage: clox-bench [--runs n] [--save file] [--baseline file] [--max-regression percent]\n"
+                    "                  [program.lox | directory]...\n"
+                    "Runs every .lox file in " CLOX_BENCH_DIR " unless told otherwise.\n");
+    exit(64);
+}
+
+static char* readFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = malloc(fileSize + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[fileSize] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+// One run in a fresh VM, with the program's own output thrown away.
+static bool runOnce(const char* source, double* seconds, unsigned long* instructions, size_t* peakHeap) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null  = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    initVM();
+    double start           = now();
+    InterpretResult result = interpret(source);
+    *seconds               = now() - start;
+    *instructions          = vm.instructionCount;
+    *peakHeap              = gcStats.peakHeap + vm.isolatePeakHeap;
+    freeVM();
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return result == INTERPRET_OK;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double left  = *(const double*) a;
+    double right = *(const double*) b;
+    return left < right ? -1 : left > right;
+}
+
+static bool runBenchmark(const char* path, int runs, Result* result) {
+    const char* base = strrchr(path, '/');
+    base             = base == NULL ? path : base + 1;
+    snprintf(result->name, sizeof(result->name), "%.*s", (int) strcspn(base, "."), base);
+
+    char* source  = readFile(path);
+    double* times = malloc(sizeof(double) * runs);
+    if (times == NULL) exit(1);
+    bool ok = true;
+    for (int i = 0; ok && i < runs; i++) {
+        ok = runOnce(source, &times[i], &result->instructions, &result->peakHeap);
+    }
+    free(source);
+    if (!ok) {
+        free(times);
+        return false;
+    }
+
+    qsort(times, runs, sizeof(double), compareDoubles);
+    result->median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    // Nearest rank.
+    result->p95 = times[(int) ceil(0.95 * runs) - 1];
+    free(times);
+    return true;
+}
+
+static bool isLoxFile(const char* name) {
+    size_t length = strlen(name);
+    return length > 4 && strcmp(name + length - 4, ".lox") == 0;
+}
+
+static int compareNames(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Add path, or the .lox files in it if it is a directory, sorted by name.
+static void addPrograms(const char* path, char** programs, int* count) {
+    DIR* directory = opendir(path);
+    if (directory == NULL) {
+        if (*count == BENCHMARKS_MAX) return;
+        programs[(*count)++] = strdup(path);
+        return;
+    }
+
+    int first = *count;
+    for (struct dirent* entry; (entry = readdir(directory)) != NULL && *count < BENCHMARKS_MAX;) {
+        if (!isLoxFile(entry->d_name)) continue;
+        char* program = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (program == NULL) exit(1);
+        sprintf(program, "%s/%s", path, entry->d_name);
+        programs[(*count)++] = program;
+    }
+    closedir(directory);
+    qsort(programs + first, *count - first, sizeof(char*), compareNames);
+}
+
+static bool saveResults(const char* path, Results* results) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    fprintf(file, "{\n");
+    for (int i = 0; i < results->count; i++) {
+        Result* result = &results->results[i];
+        // One benchmark per line, which is all loadResults() understands.
+        fprintf(file, "  \"%s\": {\"median\": %.6f, \"p95\": %.6f, \"instructions\": %lu, \"peakHeap\": %zu}%s\n",
+                result->name, result->median, result->p95, result->instructions, result->peakHeap,
+                i < results->count - 1 ? "," : "");
+    }
+    fprintf(file, "}\n");
+    return fclose(file) == 0;
+}
+
+static bool loadResults(const char* path, Results* results) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+    char line[512];
+    results->count = 0;
+    while (fgets(line, sizeof(line), file) != NULL && results->count < BENCHMARKS_MAX) {
+        Result* result = &results->results[results->count];
+        if (sscanf(line, " \"%63[^\"]\": {\"median\": %lf, \"p95\": %lf, \"instructions\": %lu, \"peakHeap\": %zu}",
+                   result->name, &result->median, &result->p95, &result->instructions, &result->peakHeap) == 5) {
+            results->count++;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static Result* findResult(Results* results, const char* name) {
+    for (int i = 0; i < results->count; i++) {
+        if (strcmp(results->results[i].name, name) == 0) return &results->results[i];
+    }
+    return NULL;
+}
+
+static double change(double now, double then) {
+    return then > 0 ? 100 * (now - then) / then : 0;
+}
+
+int main(int argc, const char* argv[]) {
+    int runs                 = 5;
+    const char* savePath     = NULL;
+    const char* baselinePath = NULL;
+    double maxRegression     = -1;
+    char* programs[BENCHMARKS_MAX];
+    int programCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0) {
+            if (++i == argc) usage();
+            runs = atoi(argv[i]);
+            if (runs < 1) usage();
+        } else if (strcmp(argv[i], "--save") == 0) {
+            if (++i == argc) usage();
+            savePath = argv[i];
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            if (++i == argc) usage();
+            baselinePath = argv[i];
+        } else if (strcmp(argv[i], "--max-regression") == 0) {
+            if (++i == argc) usage();
+            maxRegression = atof(argv[i]);
+            if (maxRegression < 0) usage();
+        } else if (argv[i][0] != '-') {
+            addPrograms(argv[i], programs, &programCount);
+        } else {
+            usage();
+        }
+    }
+    if (programCount == 0) addPrograms(CLOX_BENCH_DIR, programs, &programCount);
+    if (programCount == 0) {
+        fprintf(stderr, "No benchmarks found.\n");
+        exit(66);
+    }
+
+    static Results baseline;
+    if (baselinePath != NULL && !loadResults(baselinePath, &baseline)) {
+        fprintf(stderr, "Could not read \"%s\".\n", baselinePath);
+        exit(66);
+    }
+
+    startMarkers(1);
+    static Results results;
+    bool failed    = false;
+    bool regressed = false;
+    printf("%-16s %10s %10s %14s %12s", "benchmark", "median ms", "p95 ms", "instructions", "peak heap");
+    printf(baselinePath != NULL ? " %10s %10s\n" : "\n", "time", "instrs");
+    for (int i = 0; i < programCount; i++) {
+        Result* result = &results.results[results.count];
+        if (!runBenchmark(programs[i], runs, result)) {
+            fprintf(stderr, "%s failed.\n", programs[i]);
+            failed = true;
+            continue;
+        }
+        results.count++;
+
+        printf("%-16s %10.2f %10.2f %14lu %10.1fMB", result->name, result->median * 1000, result->p95 * 1000,
+               result->instructions, result->peakHeap / (1024.0 * 1024.0));
+        Result* before = baselinePath != NULL ? findResult(&baseline, result->name) : NULL;
+        if (before != NULL) {
+            double slower = change(result->median, before->median);
+            printf(" %+9.1f%% %+9.1f%%", slower, change((double) result->instructions, (double) before->instructions));
+            if (maxRegression >= 0 && slower > maxRegression) {
+                printf("  regressed");
+                regressed = true;
+            }
+        } else if (baselinePath != NULL) {
+            printf(" %10s %10s", "new", "new");
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (savePath != NULL && !saveResults(savePath, &results)) {
+        fprintf(stderr, "Could not write \"%s\".\n", savePath);
+        failed = true;
+    }
+    for (int i = 0; i < programCount; i++) free(programs[i]);
+    freeIsolates();
+    stopMarkers();
+    return failed ? 70 : regressed ? 1 : 0;
+}
@@ -0,0 +1,535 @@
+/*
+ * clox-microbench times single components outside the interpreter loop:
+ * Table operations at set load factors and tombstone ratios, the scanner,
+ * string hashing and interning, and allocation.
+ *
+ * Every case is run once to warm up and then --samples times. A sample
+ * times a whole batch of operations; the report gives the median and the
+ * fastest sample per operation, and the median absolute deviation as a
+ * percentage of the median, which says how far the numbers can be trusted.
+ *
+ * The collector is held off (vm.nextGC at its maximum) except where a case
+ * says it measures collections, since the keys live only in C arrays here.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gcstats.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+/*
+ * Table cases use tables of this capacity, filled to the case's load
+ * factor. A table grows at 7/8 full to a capacity it fills 7/16 of, so
+ * loads from 44% to 87% are the ones a table really runs at, and the only
+ * ones reachable by filling.
+ */
+#define TABLE_CAPACITY 4096
+#define KEYS_MAX TABLE_CAPACITY
+// Keys inserted and deleted again to leave deleted slots behind.
+#define FILLERS_MAX (64 * 1024)
+#define SCANNER_BYTES (4 * 1024 * 1024)
+#define INTERN_STRINGS 20000
+// Hash cases hash slices of a buffer this size, which stays in cache, until they have hashed HASH_TOTAL bytes.
+#define HASH_BUFFER (256 * 1024)
+#define HASH_TOTAL (64 * 1024 * 1024)
+// Strings interned between the collections of the churn case, and how many rounds.
+#define CHURN_BATCH 1000
+#define CHURN_ROUNDS 200
+#define ALLOCATIONS 100000
+
+typedef struct {
+    const char* name;
+    // A load factor or tombstone ratio in percent, a size in bytes, or which variant to run.
+    int param;
+    // Runs one sample, timing only the part that is measured, and says how much it did.
+    double (*sample)(int param, size_t* units);
+    const char* unit;
+    // Whether the case sets up a VM of its own rather than using the shared one.
+    bool ownVM;
+} Case;
+
+static ObjString* keys[KEYS_MAX];
+static ObjString* missing[KEYS_MAX];
+static ObjString* fillers[FILLERS_MAX];
+static char* source;
+static char* hashBuffer;
+// Where the hash cases leave their result, so the hashing is not optimized away.
+static volatile uint32_t hashSink;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static void holdCollections() {
+    vm.nextGC = SIZE_MAX;
+}
+
+static ObjString* makeKey(const char* prefix, int i) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "%s%d", prefix, i);
+    return copyString(name, length);
+}
+
+static void makeKeys() {
+    for (int i = 0; i < KEYS_MAX; i++) {
+        keys[i]    = makeKey("key", i);
+        missing[i] = makeKey("absent", i);
+    }
+    for (int i = 0; i < FILLERS_MAX; i++) {
+        fillers[i] = makeKey("filler", i);
+    }
+}
+
+static int keysForLoad(int percent) {
+    return TABLE_CAPACITY * percent / 100;
+}
+
+// The case names give the load, so a table that ends up another size would make them lie.
+static void checkCapacity(Table* table) {
+    if (table->capacity != TABLE_CAPACITY) {
+        fprintf(stderr, "A table meant to have %d slots has %d.\n", TABLE_CAPACITY, table->capacity);
+        exit(70);
+    }
+}
+
+static void fillTable(Table* table, int count) {
+    initTable(table);
+    for (int i = 0; i < count; i++) {
+        tableSet(table, keys[i], NUMBER_VAL(i));
+    }
+    checkCapacity(table);
+}
+
+static double tableGetHit(int load, size_t* units) {
+    Table table;
+    int count = keysForLoad(load);
+    fillTable(&table, count);
+
+    Value value;
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableGet(&table, keys[i], &value);
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = count;
+    return seconds;
+}
+
+static double tableGetMiss(int load, size_t* units) {
+    Table table;
+    int count = keysForLoad(load);
+    fillTable(&table, count);
+
+    Value value;
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableGet(&table, missing[i], &value);
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = count;
+    return seconds;
+}
+
+// From empty, growing on the way.
+static double tableSetNew(int load, size_t* units) {
+    Table table;
+    int count = keysForLoad(load);
+    initTable(&table);
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = count;
+    return seconds;
+}
+
+static double tableSetExisting(int load, size_t* units) {
+    Table table;
+    int count = keysForLoad(load);
+    fillTable(&table, count);
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableSet(&table, keys[i], NUMBER_VAL(-i));
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = count;
+    return seconds;
+}
+
+static double tableDeleteAll(int load, size_t* units) {
+    Table table;
+    int count = keysForLoad(load);
+    fillTable(&table, count);
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableDelete(&table, keys[i]);
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = count;
+    return seconds;
+}
+
+/*
+ * Filled to a load of 50%, with about the given share of the slots then
+ * marked deleted; looks up the live keys and as many missing ones. A delete
+ * leaves a deleted slot only in a group with no empty slot, so deleting
+ * live keys would mostly leave empty ones. Instead, fillers take the table
+ * to just under its maximum load and are deleted again, until enough of
+ * them were in full groups. How many that is goes by rounds of fillers, so
+ * the shares the cases ask for are ones a round ends close to.
+ */
+static double tableGetTombstones(int ratio, size_t* units) {
+    Table table;
+    int count      = keysForLoad(50);
+    int tombstones = keysForLoad(ratio);
+    fillTable(&table, count);
+    int used = 0;
+    while (table.tombstones < tombstones) {
+        int first = used;
+        while (table.count + table.tombstones < keysForLoad(87)) {
+            if (used == FILLERS_MAX) {
+                fprintf(stderr, "Ran out of fillers at %d deleted slots.\n", table.tombstones);
+                exit(70);
+            }
+            tableSet(&table, fillers[used++], NIL_VAL);
+        }
+        for (int i = first; i < used; i++) {
+            tableDelete(&table, fillers[i]);
+        }
+    }
+    checkCapacity(&table);
+    if (table.tombstones > tombstones + keysForLoad(1)) {
+        fprintf(stderr, "Asked for %d%% deleted slots, got %d of %d.\n", ratio, table.tombstones, TABLE_CAPACITY);
+        exit(70);
+    }
+
+    Value value;
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableGet(&table, keys[i], &value);
+    }
+    for (int i = 0; i < count; i++) {
+        tableGet(&table, missing[i], &value);
+    }
+    double seconds = now() - start;
+    freeTable(&table);
+    *units = 2 * (size_t) count;
+    return seconds;
+}
+
+// Lox covering every kind of token, repeated with changing names and numbers.
+static void makeSource() {
+    source = malloc(SCANNER_BYTES + 512);
+    if (source == NULL) exit(1);
+    size_t length = 0;
+    for (int i = 0; length < SCANNER_BYTES; i++) {
+        length += sprintf(source + length,
+                          "// Section %d of the scanner benchmark.\n"
+                          "class Shape%d < Base { init(w, h) { this.w = w; this.h = h; } }\n"
+                          "fun area%d(s) { if (s.w >= 0 and s.h <= %d.5) return s.w * s.h / 2; else return -1; }\n"
+                          "var name%d = \"shape number %d\"; while (!false or nil != true) { print name%d; }\n",
+                          i, i, i, i, i, i, i);
+    }
+}
+
+static double scanAll(int _, size_t* units) {
+    double start = now();
+    initScanner(source);
+    size_t tokens = 0;
+    for (Token token = scanToken(); token.type != TOKEN_EOF; token = scanToken()) {
+        tokens++;
+    }
+    double seconds = now() - start;
+    if (tokens == 0) exit(1);
+    *units = strlen(source);
+    return seconds;
+}
+
+// Strings the intern table has not seen: hash, miss, allocate and insert.
+static void makeHashBuffer() {
+    hashBuffer = malloc(HASH_BUFFER);
+    if (hashBuffer == NULL) exit(1);
+    for (int i = 0; i < HASH_BUFFER; i++) {
+        hashBuffer[i] = (char) (i * 31 + (i >> 8));
+    }
+}
+
+static double hashBytes(int size, size_t* units) {
+    int slices     = HASH_BUFFER / size;
+    uint32_t total = 0;
+    double start   = now();
+    for (size_t hashed = 0; hashed < HASH_TOTAL; hashed += (size_t) slices * size) {
+        for (int i = 0; i < slices; i++) {
+            total += hashString(hashBuffer + (size_t) i * size, size);
+        }
+    }
+    double seconds = now() - start;
+    hashSink       = total;
+    *units         = HASH_TOTAL;
+    return seconds;
+}
+
+static double hashBytesSeeded(int size, size_t* units) {
+    hashSeed       = 0x9e3779b97f4a7c15ull;
+    double seconds = hashBytes(size, units);
+    hashSeed       = 0;
+    return seconds;
+}
+
+static double internNew(int _, size_t* units) {
+    initVM();
+    holdCollections();
+    char name[32];
+    double start = now();
+    for (int i = 0; i < INTERN_STRINGS; i++) {
+        int length = snprintf(name, sizeof(name), "fresh%d", i);
+        copyString(name, length);
+    }
+    double seconds = now() - start;
+    freeVM();
+    *units = INTERN_STRINGS;
+    return seconds;
+}
+
+// Strings it has: hash and hit.
+static double internExisting(int _, size_t* units) {
+    initVM();
+    holdCollections();
+    char name[32];
+    for (int i = 0; i < INTERN_STRINGS; i++) {
+        int length = snprintf(name, sizeof(name), "known%d", i);
+        copyString(name, length);
+    }
+
+    double start = now();
+    for (int i = 0; i < INTERN_STRINGS; i++) {
+        int length = snprintf(name, sizeof(name), "known%d", i);
+        copyString(name, length);
+    }
+    double seconds = now() - start;
+    freeVM();
+    *units = INTERN_STRINGS;
+    return seconds;
+}
+
+/*
+ * A long-running program's intern table: fresh strings that die young,
+ * purged from the table by a collection every CHURN_BATCH, next to a few
+ * that stay. Tombstones that were never cleared would make each round
+ * slower than the last and the table ever bigger.
+ */
+static double internChurn(int _, size_t* units) {
+    initVM();
+    holdCollections();
+    char name[32];
+    for (int i = 0; i < 64; i++) {
+        int length = snprintf(name, sizeof(name), "kept%d", i);
+        push(OBJ_VAL(copyString(name, length)));
+    }
+
+    double start = now();
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            int length = snprintf(name, sizeof(name), "churn%d.%d", round, i);
+            copyString(name, length);
+            length = snprintf(name, sizeof(name), "kept%d", i % 64);
+            copyString(name, length);
+        }
+        collectGarbage();
+    }
+    double seconds = now() - start;
+    if (vm.strings.capacity > 4 * CHURN_BATCH) {
+        fprintf(stderr, "The intern table grew to %d slots.\n", vm.strings.capacity);
+        exit(70);
+    }
+    freeVM();
+    *units = 2 * (size_t) CHURN_ROUNDS * CHURN_BATCH;
+    return seconds;
+}
+
+static double reallocatePairs(int size, size_t* units) {
+    static void* blocks[ALLOCATIONS];
+    double start = now();
+    for (int i = 0; i < ALLOCATIONS; i++) {
+        blocks[i] = reallocate(NULL, 0, size);
+    }
+    for (int i = 0; i < ALLOCATIONS; i++) {
+        reallocate(blocks[i], size, 0);
+    }
+    double seconds = now() - start;
+    *units = ALLOCATIONS;
+    return seconds;
+}
+
+// Objects through allocateObj(), freed untimed by freeVM().
+static double allocateObjects(int instances, size_t* units) {
+    initVM();
+    holdCollections();
+    ObjClass* class = newClass(copyString("Point", 5));
+    push(OBJ_VAL(class));
+
+    double start = now();
+    for (int i = 0; i < ALLOCATIONS; i++) {
+        if (instances) {
+            newInstance(class);
+        } else {
+            newUpvalue(NULL);
+        }
+    }
+    double seconds = now() - start;
+    freeVM();
+    *units = ALLOCATIONS;
+    return seconds;
+}
+
+// The same garbage with the collector running, so the cost includes reclaiming it.
+static double allocateCollected(int _, size_t* units) {
+    initVM();
+    ObjClass* class = newClass(copyString("Point", 5));
+    push(OBJ_VAL(class));
+
+    double start = now();
+    for (int i = 0; i < ALLOCATIONS; i++) {
+        newInstance(class);
+    }
+    double seconds = now() - start;
+    freeVM();
+    *units = ALLOCATIONS;
+    return seconds;
+}
+
+static Case cases[] = {
+        {"table get hit, load 50%", 50, tableGetHit, "op"},
+        {"table get hit, load 70%", 70, tableGetHit, "op"},
+        {"table get hit, load 85%", 85, tableGetHit, "op"},
+        {"table get miss, load 50%", 50, tableGetMiss, "op"},
+        {"table get miss, load 70%", 70, tableGetMiss, "op"},
+        {"table get miss, load 85%", 85, tableGetMiss, "op"},
+        {"table set new, to load 70%", 70, tableSetNew, "op"},
+        {"table set existing, load 70%", 70, tableSetExisting, "op"},
+        {"table delete, load 70%", 70, tableDeleteAll, "op"},
+        {"table get, 50% + 0% deleted", 0, tableGetTombstones, "op"},
+        {"table get, 50% + 17% deleted", 17, tableGetTombstones, "op"},
+        {"table get, 50% + 30% deleted", 30, tableGetTombstones, "op"},
+        {"scanToken", 0, scanAll, "byte"},
+        {"hashString 8 bytes", 8, hashBytes, "byte"},
+        {"hashString 16 bytes", 16, hashBytes, "byte"},
+        {"hashString 64 bytes", 64, hashBytes, "byte"},
+        {"hashString 1 KB", 1024, hashBytes, "byte"},
+        {"hashString 64 KB", 64 * 1024, hashBytes, "byte"},
+        {"hashString 8 bytes, seeded", 8, hashBytesSeeded, "byte"},
+        {"hashString 1 KB, seeded", 1024, hashBytesSeeded, "byte"},
+        {"copyString, new", 0, internNew, "op", true},
+        {"copyString, interned", 0, internExisting, "op", true},
+        {"copyString, churn, collecting", 0, internChurn, "op", true},
+        {"reallocate 16 bytes", 16, reallocatePairs, "op"},
+        {"reallocate 256 bytes", 256, reallocatePairs, "op"},
+        {"allocate upvalue", 0, allocateObjects, "op", true},
+        {"allocate instance", 1, allocateObjects, "op", true},
+        {"allocate instance, collected", 0, allocateCollected, "op", true},
+};
+
+static int compareDoubles(const void* a, const void* b) {
+    double left  = *(const double*) a;
+    double right = *(const double*) b;
+    return left < right ? -1 : left > right;
+}
+
+static double median(double* values, int count) {
+    qsort(values, count, sizeof(double), compareDoubles);
+    return count % 2 == 1 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static void runCase(Case* c, int samples) {
+    double* perUnit = malloc(sizeof(double) * samples);
+    double* spread  = malloc(sizeof(double) * samples);
+    if (perUnit == NULL || spread == NULL) exit(1);
+
+    size_t units;
+    c->sample(c->param, &units);
+    for (int i = 0; i < samples; i++) {
+        perUnit[i] = c->sample(c->param, &units) / (double) units;
+    }
+    double middle = median(perUnit, samples);
+    double best   = perUnit[0];
+    for (int i = 0; i < samples; i++) {
+        spread[i] = fabs(perUnit[i] - middle);
+    }
+    double deviation = median(spread, samples);
+
+    if (strcmp(c->unit, "byte") == 0 && 1 / middle >= 1024 * 1024 * 1024) {
+        printf("%-32s %10.2f GB/s  %10.2f GB/s  %6.1f%%\n", c->name, 1 / middle / (1024 * 1024 * 1024),
+               1 / best / (1024 * 1024 * 1024), 100 * deviation / middle);
+    } else if (strcmp(c->unit, "byte") == 0) {
+        printf("%-32s %10.1f MB/s  %10.1f MB/s  %6.1f%%\n", c->name, 1 / middle / (1024 * 1024),
+               1 / best / (1024 * 1024), 100 * deviation / middle);
+    } else {
+        printf("%-32s %10.1f ns/op %10.1f ns/op %6.1f%%\n", c->name, middle * 1e9, best * 1e9, 100 * deviation / middle);
+    }
+    fflush(stdout);
+    free(perUnit);
+    free(spread);
+}
+
+int main(int argc, const char* argv[]) {
+    int samples        = 11;
+    const char* filter = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            samples = 0;
+        }
+        if (samples < 1) {
+            fprintf(stderr, "Usage: clox-microbench [--samples n] [--filter substring]\n");
+            exit(64);
+        }
+    }
+
+    // The table cases share one VM and one set of keys.
+    initVM();
+    holdCollections();
+    makeKeys();
+    makeSource();
+    makeHashBuffer();
+
+    printf("%-32s %16s %16s %7s\n", "case", "median", "best", "MAD");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (filter != NULL && strstr(cases[i].name, filter) == NULL) continue;
+        if (cases[i].ownVM) {
+            freeVM();
+            runCase(&cases[i], samples);
+            initVM();
+            holdCollections();
+            makeKeys();
+        } else {
+            runCase(&cases[i], samples);
+        }
+    }
+
+    freeVM();
+    free(source);
+    free(hashBuffer);
+    return 0;
+}
@@ -53,6 +53,12 @@ typedef enum {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    // Join the top n values into one string, each as print shows it.
+    OP_BUILD_STRING,
+    // Gather the top n values into a new list.
+    OP_BUILD_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
 } OpCode;
 
 // The Chunk struct represents a dynamic array in memory.
@@ -10,11 +10,17 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+// clox-bench builds with CLOX_BENCH: no debugging output or stress collections,
+// and run() counts the instructions it executes.
+#ifndef CLOX_BENCH
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
+#endif
 // #define DEBUG_LOG_GC
+// Count opcodes, calls and operand types, written as CSV at exit (see opcount.h).
+// #define DEBUG_COUNT_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
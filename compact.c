@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "compact.h"
+#include "eventloop.h"
+#include "marker.h"
+#include "memory.h"
+#include "vm.h"
+
+// Arenas are aligned to their size, so the arena of any pointer is a mask away.
+#define ARENA_SIZE (256 * 1024)
+// Anything bigger stays where malloc() put it.
+#define BLOCK_MAX (ARENA_SIZE / 8)
+
+/*
+ * Every block in an arena starts with its size, so that it can be given back
+ * without trusting the size its owner passes to reallocate().
+ */
+typedef struct {
+    size_t size;
+    _Alignas(8) char bytes[];
+} Block;
+
+typedef struct Arena {
+    struct Arena* next;
+    size_t used;
+    _Alignas(8) char bytes[];
+} Arena;
+
+/*
+ * The old space: the arenas compaction packed objects into. bases holds
+ * their addresses in order, for inOldSpace(). used counts every byte handed
+ * out and live only those of blocks still in use, so the difference is the
+ * holes the dead left behind.
+ */
+typedef struct {
+    Arena* arenas;
+    uintptr_t* bases;
+    int arenaCount;
+    int arenaCapacity;
+    size_t used;
+    size_t live;
+} OldSpace;
+
+bool compactingGC                      = false;
+_Thread_local bool compactionRequested = false;
+static _Thread_local OldSpace oldSpace;
+
+size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FIBER: return sizeof(ObjFiber);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_ROPE: return sizeof(ObjRope);
+        case OBJ_STRING: return STRING_OBJ_SIZE((ObjString*) object);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+static bool inSpace(OldSpace* space, void* pointer) {
+    uintptr_t base = (uintptr_t) pointer & ~(uintptr_t) (ARENA_SIZE - 1);
+    int low        = 0;
+    int high       = space->arenaCount - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (space->bases[middle] == base) return true;
+        if (space->bases[middle] < base) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return false;
+}
+
+bool inOldSpace(void* pointer) {
+    return inSpace(&oldSpace, pointer);
+}
+
+void considerCompaction(size_t youngBytes) {
+    if (!compactingGC) return;
+    size_t holes = oldSpace.used - oldSpace.live;
+    if (youngBytes + holes > oldSpace.live) compactionRequested = true;
+}
+
+static Arena* newArena(OldSpace* space) {
+    void* memory;
+    if (posix_memalign(&memory, ARENA_SIZE, ARENA_SIZE) != 0) exit(1);
+    Arena* arena  = memory;
+    arena->next   = space->arenas;
+    arena->used   = 0;
+    space->arenas = arena;
+
+    if (space->arenaCount == space->arenaCapacity) {
+        space->arenaCapacity = GROW_CAPACITY(space->arenaCapacity);
+        space->bases         = realloc(space->bases, sizeof(uintptr_t) * space->arenaCapacity);
+        if (space->bases == NULL) exit(1);
+    }
+    int i = space->arenaCount++;
+    for (; i > 0 && space->bases[i - 1] > (uintptr_t) arena; i--) {
+        space->bases[i] = space->bases[i - 1];
+    }
+    space->bases[i] = (uintptr_t) arena;
+    return arena;
+}
+
+static void* allocateOld(OldSpace* space, size_t size) {
+    size_t blockSize = (sizeof(Block) + size + 7) & ~(size_t) 7;
+    Arena* arena     = space->arenas;
+    if (arena == NULL || sizeof(Arena) + arena->used + blockSize > ARENA_SIZE) {
+        arena = newArena(space);
+    }
+
+    Block* block = (Block*) (arena->bytes + arena->used);
+    block->size  = blockSize;
+    arena->used += blockSize;
+    space->used += blockSize;
+    space->live += blockSize;
+    return block->bytes;
+}
+
+static Block* blockOf(void* pointer) {
+    return (Block*) ((char*) pointer - offsetof(Block, bytes));
+}
+
+void* reallocateOld(void* pointer, size_t newSize) {
+    Block* block = blockOf(pointer);
+    void* result = NULL;
+    if (newSize != 0) {
+        // A block that grows moves back out to malloc().
+        result = malloc(newSize);
+        if (result == NULL) return NULL;
+        size_t size = block->size - sizeof(Block);
+        memcpy(result, pointer, size < newSize ? size : newSize);
+    }
+    oldSpace.live -= block->size;
+    return result;
+}
+
+static void freeSpace(OldSpace* space) {
+    while (space->arenas != NULL) {
+        Arena* next = space->arenas->next;
+        free(space->arenas);
+        space->arenas = next;
+    }
+    free(space->bases);
+}
+
+void freeOldSpace() {
+    freeSpace(&oldSpace);
+    oldSpace = (OldSpace){NULL, NULL, 0, 0, 0, 0};
+}
+
+// While the heap is being compacted, every old object's next field holds its new address.
+Obj* forwardObject(Obj* object) {
+    return object == NULL ? NULL : object->next;
+}
+
+Value forwardValue(Value value) {
+    return IS_OBJ(value) ? OBJ_VAL(forwardObject(AS_OBJ(value))) : value;
+}
+
+// Copy an array an object owns into the new space and give the old one back.
+static void* moveArray(OldSpace* space, void* array, size_t size) {
+    if (array == NULL || size == 0 || size > BLOCK_MAX) return array;
+    void* copy = allocateOld(space, size);
+    memcpy(copy, array, size);
+    if (!inOldSpace(array)) free(array);
+    return copy;
+}
+
+static void moveTable(OldSpace* space, Table* table) {
+    table->entries = moveArray(space, table->entries, TABLE_BYTES(table->capacity));
+}
+
+static Obj* moveObject(OldSpace* space, Obj* object) {
+    size_t size = objectSize(object);
+    // A string too long for an arena still moves, to a block of its own:
+    // its next field is about to become its forwarding pointer.
+    Obj* copy = size > BLOCK_MAX ? malloc(size) : allocateOld(space, size);
+    if (copy == NULL) exit(1);
+    memcpy(copy, object, size);
+    copy->next = NULL;
+
+    switch (copy->type) {
+        case OBJ_CLASS: {
+            ObjClass* class = (ObjClass*) copy;
+            class->methods  = moveArray(space, class->methods, sizeof(ObjClosure*) * class->methodCount);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) copy;
+            closure->upvalues   = moveArray(space, closure->upvalues, sizeof(ObjUpvalue*) * closure->upvalueCount);
+            closure->superMethods =
+                    moveArray(space, closure->superMethods, sizeof(ObjClosure*) * closure->superMethodCount);
+            break;
+        }
+        case OBJ_INSTANCE:
+            moveTable(space, &((ObjInstance*) copy)->fields);
+            break;
+        case OBJ_LIST: {
+            ValueArray* items = &((ObjList*) copy)->items;
+            items->values     = moveArray(space, items->values, sizeof(Value) * items->capacity);
+            break;
+        }
+        case OBJ_STRING: {
+            // So does a string that owns its characters.
+            ObjString* string = (ObjString*) copy;
+            if (string->parent == NULL) string->chars = string->storage;
+            break;
+        }
+        case OBJ_UPVALUE: {
+            // A closed upvalue points into itself.
+            ObjUpvalue* upvalue = (ObjUpvalue*) copy;
+            if (upvalue->location == &((ObjUpvalue*) object)->closed) {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+static void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        entry->key   = (ObjString*) forwardObject((Obj*) entry->key);
+        entry->value = forwardValue(entry->value);
+    }
+}
+
+static void forwardFields(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            bound->method         = (ObjClosure*) forwardObject((Obj*) bound->method);
+            bound->reciever       = forwardValue(bound->reciever);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* class = (ObjClass*) object;
+            class->name     = (ObjString*) forwardObject((Obj*) class->name);
+            for (int i = 0; i < class->methodCount; i++) {
+                class->methods[i] = (ObjClosure*) forwardObject((Obj*) class->methods[i]);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            closure->function   = (ObjFunction*) forwardObject((Obj*) closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (ObjUpvalue*) forwardObject((Obj*) closure->upvalues[i]);
+            }
+            for (int i = 0; i < closure->superMethodCount; i++) {
+                closure->superMethods[i] = (ObjClosure*) forwardObject((Obj*) closure->superMethods[i]);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                *slot = forwardValue(*slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                fiber->frames[i].closure = (ObjClosure*) forwardObject((Obj*) fiber->frames[i].closure);
+            }
+            fiber->openUpvalues = (ObjUpvalue*) forwardObject((Obj*) fiber->openUpvalues);
+            fiber->caller       = (ObjFiber*) forwardObject((Obj*) fiber->caller);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            function->name        = (ObjString*) forwardObject((Obj*) function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                function->chunk.constants.values[i] = forwardValue(function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            instance->class       = (ObjClass*) forwardObject((Obj*) instance->class);
+            forwardTable(&instance->fields);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) object;
+            for (int i = 0; i < list->items.count; i++) {
+                list->items.values[i] = forwardValue(list->items.values[i]);
+            }
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            rope->left    = forwardObject(rope->left);
+            rope->right   = forwardObject(rope->right);
+            rope->flat    = (ObjString*) forwardObject((Obj*) rope->flat);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*) object;
+            upvalue->closed     = forwardValue(upvalue->closed);
+            upvalue->next       = (ObjUpvalue*) forwardObject((Obj*) upvalue->next);
+            upvalue->fiber      = (ObjFiber*) forwardObject((Obj*) upvalue->fiber);
+            break;
+        }
+        case OBJ_STRING: {
+            // A view keeps its place in its parent, wherever that moved.
+            ObjString* string = (ObjString*) object;
+            if (string->parent != NULL) {
+                ptrdiff_t start = string->chars - string->parent->storage;
+                string->parent  = (ObjString*) forwardObject((Obj*) string->parent);
+                string->chars   = string->parent->storage + start;
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+static void forwardRoots() {
+    vm.fiber      = (ObjFiber*) forwardObject((Obj*) vm.fiber);
+    vm.mainFiber  = (ObjFiber*) forwardObject((Obj*) vm.mainFiber);
+    vm.initString = (ObjString*) forwardObject((Obj*) vm.initString);
+    forwardTable(&vm.globals);
+    // The string table finds a key by its hash, which moves along with it.
+    forwardTable(&vm.strings);
+    for (int i = 0; i < vm.selectorCount; i++) {
+        vm.selectors[i] = (ObjString*) forwardObject((Obj*) vm.selectors[i]);
+    }
+    forwardEventLoop();
+}
+
+void compactHeap() {
+    compactionRequested = false;
+    // A background marker is reading the heap; try again after the cycle.
+    if (concurrentMark != NULL) return;
+
+    // Flush the running fiber's registers so it is fixed up like any other fiber.
+    vm.fiber->frameCount   = vm.frameCount;
+    vm.fiber->stackTop     = vm.stackTop;
+    vm.fiber->openUpvalues = vm.openUpvalues;
+
+    // Evacuate every object in list order, leaving its new address in its old next field.
+    OldSpace space = {NULL, NULL, 0, 0, 0, 0};
+    int count      = 0;
+    int capacity   = 0;
+    Obj** moved    = NULL;
+    Obj* first     = NULL;
+    Obj* last      = NULL;
+    for (Obj* object = vm.objects; object != NULL;) {
+        Obj* next = object->next;
+        Obj* copy = moveObject(&space, object);
+        if (last == NULL) {
+            first = copy;
+        } else {
+            last->next = copy;
+        }
+        last         = copy;
+        object->next = copy;
+
+        if (count == capacity) {
+            capacity = GROW_CAPACITY(capacity);
+            moved    = realloc(moved, sizeof(Obj*) * capacity);
+            if (moved == NULL) exit(1);
+        }
+        moved[count++] = object;
+        object         = next;
+    }
+
+    for (Obj* object = first; object != NULL; object = object->next) {
+        forwardFields(object);
+    }
+    forwardRoots();
+
+    // Nothing refers to the old copies any more.
+    for (int i = 0; i < count; i++) {
+        if (!inOldSpace(moved[i])) free(moved[i]);
+    }
+    free(moved);
+    freeSpace(&oldSpace);
+    oldSpace   = space;
+    vm.objects = first;
+#ifdef __GLIBC__
+    // free() only gives memory back from the top of the heap; the holes the
+    // evacuation left in the middle have to be handed back explicitly.
+    malloc_trim(0);
+#endif
+
+    vm.frames       = vm.fiber->frames;
+    vm.openUpvalues = vm.fiber->openUpvalues;
+}
@@ -0,0 +1,47 @@
+#ifndef CLOX_COMPACT_H
+#define CLOX_COMPACT_H
+
+#include "object.h"
+
+/*
+ * Compaction (--gc-compact). Objects are born in malloc()'d memory. Once a
+ * collection finds that the survivors outside the old space, plus the holes
+ * left by the dead inside it, outweigh what is live in it, the next safepoint
+ * evacuates every object into fresh, densely packed arenas and gives the old
+ * ones back. Resident memory then follows the live data instead of the high
+ * water mark of a fragmented heap.
+ *
+ * An evacuated object leaves a forwarding pointer in its old next field, and
+ * every reference is rewritten through it: stacks, frames, tables, constant
+ * pools, upvalues and the event loop. C code keeps raw object pointers in
+ * locals all over, so compaction only runs at safepoints in run() (backward
+ * jumps and calls), where nothing but the VM holds any. No compiler is active
+ * at a safepoint, so there are no compiler roots to fix.
+ *
+ * Objects move along with the arrays that are theirs alone: closure
+ * upvalues, list items and the entries of instance and class tables. A
+ * string's characters are part of the string and move with it, and a
+ * view's follow its parent. Fiber stacks and bytecode stay where they are,
+ * as does any array too big for an arena; a string too big for one is
+ * copied to a malloc() block of its own. reallocate() hands arena memory to
+ * reallocateOld(), and a block that grows moves back out to malloc().
+ */
+
+extern bool compactingGC;
+extern _Thread_local bool compactionRequested;
+
+size_t objectSize(Obj* object);
+// Called after a sweep with the bytes of the survivors outside the old space.
+void considerCompaction(size_t youngBytes);
+void compactHeap();
+
+bool inOldSpace(void* pointer);
+// Free or grow a block in the old space. Its memory goes back with its arena.
+// Returns NULL, leaving the block alone, if malloc() has no room for it.
+void* reallocateOld(void* pointer, size_t newSize);
+void freeOldSpace();
+
+Obj* forwardObject(Obj* object);
+Value forwardValue(Value value);
+
+#endif// CLOX_COMPACT_H
@@ -12,6 +12,7 @@
 
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 
 
 #ifdef DEBUG_PRINT_CODE
@@ -94,9 +95,9 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* currentCompiler   = NULL;
-ClassCompiler* currentClass = NULL;
+_Thread_local Parser parser;
+_Thread_local Compiler* currentCompiler   = NULL;
+_Thread_local ClassCompiler* currentClass = NULL;
 
 static Chunk* currentChunk() {
     return &currentCompiler->function->chunk;
@@ -197,7 +198,7 @@ static int makeConstant(const Value value) {
 }
 
 static void emitConstant(const Value value) {
-    writeConstant(currentChunk(), value, 1);
+    writeConstant(currentChunk(), value, parser.previous.line);
 }
 
 static void patchJump(const int offset) {
@@ -338,12 +339,13 @@ static void call(bool _) {
 }
 
 static uint8_t identifierConstant(const Token* name);
+static uint8_t selectorConstant(const Token* name);
 static int resolveLocal(Compiler* compiler, const Token* name);
 static int resolveUpvalue(Compiler* compiler, Token* name);
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
-    uint8_t name = identifierConstant(&parser.previous);
+    uint8_t name = selectorConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
@@ -357,6 +359,33 @@ static void dot(bool canAssign) {
     }
 }
 
+static void list(bool _) {
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count == UINT8_MAX) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(OP_BUILD_LIST, (uint8_t) count);
+}
+
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_INDEX_SET);
+    } else {
+        emitByte(OP_INDEX_GET);
+    }
+}
+
 static void literal(bool _) {
     switch (parser.previous.type) {
         case TOKEN_FALSE:
@@ -393,6 +422,37 @@ static void string(bool _) {
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+/*
+ * "a${x}b${y}c" arrives as the tokens "a${ x }b${ y }c" (see string() in
+ * scanner.c). Every piece goes on the stack, leaving out empty text, and
+ * OP_BUILD_STRING joins them all at once.
+ */
+static void interpolation(bool _) {
+    int parts = 0;
+    do {
+        if (parser.previous.length > 3) {
+            emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 3)));
+            parts++;
+        }
+        // "${}" would otherwise read the rest of the string as a string literal.
+        if (parser.current.start[0] == '}') {
+            errorAtCurrent("Expect expression.");
+        }
+        expression();
+        parts++;
+    } while (match(TOKEN_INTERPOLATION));
+    consume(TOKEN_STRING, "Expect '}' after interpolated expression.");
+    if (parser.previous.length > 2) {
+        emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+        parts++;
+    }
+
+    if (parts > UINT8_MAX) {
+        error("Too many pieces in one interpolated string.");
+    }
+    emitBytes(OP_BUILD_STRING, (uint8_t) parts);
+}
+
 /*
  Load a variable with a given name and add it to the operand stack.
  Can 'get' or 'set' the variable.
@@ -440,17 +500,25 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    uint8_t name = selectorConstant(&parser.previous);
+
+    // super is declared around the class body, so a method always reaches it as an upvalue.
+    Token superToken = syntheticToken("super");
+    int superclass   = resolveUpvalue(currentCompiler, &superToken);
+    int site         = currentCompiler->function->superSites++;
+    if (site == UINT8_COUNT) {
+        error("Too many uses of 'super' in one function.");
+    }
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+        emitBytes(argCount, (uint8_t) superclass);
+        emitByte((uint8_t) site);
     } else {
-        namedVariable(syntheticToken("super"), false);
         emitBytes(OP_GET_SUPER, name);
+        emitBytes((uint8_t) superclass, (uint8_t) site);
     }
 }
 
@@ -521,7 +589,7 @@ static void function(FunctionType type) {
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect a method name.");
-    uint8_t constant  = identifierConstant(&parser.previous);
+    uint8_t constant  = selectorConstant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
@@ -676,6 +744,8 @@ static void caseDeclaration(int switchStart) {
 
                 emitByte(OP_CASE_COMP);
                 int thenJump = emitJump(OP_JUMP_IF_FALSE);
+                // The comparison, then the value switched on.
+                emitByte(OP_POP);
                 emitByte(OP_POP);
                 statement();
                 emitLoop(switchStart);
@@ -711,6 +781,8 @@ static void switchStatement() {
     while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
         caseDeclaration(loopStart);
     }
+    // Nothing matched: the value switched on is still on the stack.
+    emitByte(OP_POP);
 
     patchJump(endSwitch);
     consume(TOKEN_RIGHT_BRACE, "Expect '}' to conclude case statement");
@@ -860,6 +932,8 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE]    = {NULL, NULL, PREC_NONE},
         [TOKEN_RIGHT_BRACE]   = {NULL, NULL, PREC_NONE},
+        [TOKEN_LEFT_BRACKET]  = {list, subscript, PREC_CALL},
+        [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
         [TOKEN_COMMA]         = {NULL, NULL, PREC_NONE},
         [TOKEN_DOT]           = {NULL, dot, PREC_CALL},
         [TOKEN_MINUS]         = {unary, binary, PREC_TERM},
@@ -877,6 +951,7 @@ ParseRule rules[] = {
         [TOKEN_LESS_EQUAL]    = {NULL, binary, PREC_COMPARISON},
         [TOKEN_IDENTIFIER]    = {variable, NULL, PREC_NONE},
         [TOKEN_STRING]        = {string, NULL, PREC_NONE},
+        [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
         [TOKEN_NUMBER]        = {number, NULL, PREC_NONE},
         [TOKEN_AND]           = {NULL, and_, PREC_AND},
         [TOKEN_CLASS]         = {NULL, NULL, PREC_NONE},
@@ -923,6 +998,15 @@ static uint8_t identifierConstant(const Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// A method or property name, given its selector now so the VM never has to.
+static uint8_t selectorConstant(const Token* name) {
+    ObjString* string = copyString(name->start, name->length);
+    push(OBJ_VAL(string));
+    internSelector(string);
+    pop();
+    return makeConstant(OBJ_VAL(string));
+}
+
 static bool identifiersEqual(const Token* a, const Token* b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
@@ -1085,3 +1169,8 @@ void markCompilerRoots() {
         compiler = compiler->enclosing;
     }
 }
+
+void abandonCompiler() {
+    currentCompiler = NULL;
+    currentClass    = NULL;
+}
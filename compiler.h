@@ -10,5 +10,7 @@
 
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+// Forget the functions being compiled when an error unwinds compile().
+void abandonCompiler();
 
 #endif// CLOX_COMPILER_H
@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cpuprof.h"
+#include "vm.h"
+
+// Longer samples lose their innermost frames.
+#define STACK_CHARS_MAX 8192
+#define FIBERS_MAX 64
+
+typedef struct {
+    // NULL for an empty slot.
+    char* stack;
+    uint32_t hash;
+    unsigned long count;
+} Stack;
+
+typedef struct {
+    bool running;
+    // Open addressing over the distinct stacks seen.
+    Stack* stacks;
+    int count;
+    int capacity;
+} CpuProfiler;
+
+_Thread_local volatile sig_atomic_t cpuProfileTicks = 0;
+_Thread_local volatile sig_atomic_t cpuProfileInGC  = 0;
+// The part of cpuProfileTicks that landed in a collection pause.
+static _Thread_local volatile sig_atomic_t gcTicks = 0;
+static _Thread_local CpuProfiler profiler;
+
+static void onTick(int signal) {
+    cpuProfileTicks++;
+    if (cpuProfileInGC) gcTicks++;
+}
+
+bool startCpuProfile(int hertz) {
+    struct sigaction action = {0};
+    action.sa_handler       = onTick;
+    action.sa_flags         = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+    long interval         = hertz > 0 && hertz < 1000000 ? 1000000 / hertz : 1;
+    struct itimerval time = {{interval / 1000000, interval % 1000000}, {interval / 1000000, interval % 1000000}};
+    if (setitimer(ITIMER_PROF, &time, NULL) != 0) return false;
+    profiler.running = true;
+    return true;
+}
+
+void stopCpuProfile() {
+    struct itimerval off = {0};
+    setitimer(ITIMER_PROF, &off, NULL);
+    // A tick may still be pending, and SIGPROF's default is to terminate.
+    signal(SIGPROF, SIG_IGN);
+
+    for (int i = 0; i < profiler.capacity; i++) {
+        free(profiler.stacks[i].stack);
+    }
+    free(profiler.stacks);
+    profiler        = (CpuProfiler){0};
+    cpuProfileTicks = 0;
+    gcTicks         = 0;
+}
+
+void blockCpuProfileSignal() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static uint32_t hashStack(const char* stack) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = stack; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+    return hash;
+}
+
+static Stack* findStack(Stack* stacks, int capacity, const char* stack, uint32_t hash) {
+    uint32_t slot = hash & (capacity - 1);
+    while (stacks[slot].stack != NULL && (stacks[slot].hash != hash || strcmp(stacks[slot].stack, stack) != 0)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &stacks[slot];
+}
+
+static void growStacks() {
+    int capacity  = profiler.capacity == 0 ? 64 : profiler.capacity * 2;
+    Stack* stacks = calloc(capacity, sizeof(Stack));
+    if (stacks == NULL) exit(1);
+    for (int i = 0; i < profiler.capacity; i++) {
+        Stack* old = &profiler.stacks[i];
+        if (old->stack != NULL) *findStack(stacks, capacity, old->stack, old->hash) = *old;
+    }
+    free(profiler.stacks);
+    profiler.stacks   = stacks;
+    profiler.capacity = capacity;
+}
+
+static void countStack(const char* stack, unsigned long ticks) {
+    if ((profiler.count + 1) * 2 > profiler.capacity) growStacks();
+    uint32_t hash = hashStack(stack);
+    Stack* entry  = findStack(profiler.stacks, profiler.capacity, stack, hash);
+    if (entry->stack == NULL) {
+        entry->stack = strdup(stack);
+        if (entry->stack == NULL) exit(1);
+        entry->hash = hash;
+        profiler.count++;
+    }
+    entry->count += ticks;
+}
+
+// Append to stack unless it is full; false once it is.
+static bool appendFrame(char* stack, int* length, const char* function, int line) {
+    const char* separator = *length == 0 ? "" : ";";
+    int written = line < 0 ? snprintf(stack + *length, STACK_CHARS_MAX - *length, "%s%s", separator, function)
+                           : snprintf(stack + *length, STACK_CHARS_MAX - *length, "%s%s:%d", separator, function, line);
+    if (written >= STACK_CHARS_MAX - *length) {
+        stack[*length] = '\0';
+        return false;
+    }
+    *length += written;
+    return true;
+}
+
+static bool appendFrames(char* stack, int* length, CallFrame* frames, int frameCount) {
+    for (int i = 0; i < frameCount; i++) {
+        ObjFunction* function = frames[i].closure->function;
+        Chunk* chunk          = &function->chunk;
+        // ip is past the instruction running, unless the frame has not started yet.
+        int line = chunk->lines[frames[i].ip > chunk->bcode ? frames[i].ip - chunk->bcode - 1 : 0];
+        if (!appendFrame(stack, length, function->name == NULL ? "script" : function->name->chars, line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sampleCpuProfile() {
+    sig_atomic_t ticks = cpuProfileTicks;
+    sig_atomic_t inGC  = gcTicks;
+    cpuProfileTicks    = 0;
+    gcTicks            = 0;
+    if (!profiler.running || ticks == 0) return;
+
+    ObjFiber* fibers[FIBERS_MAX];
+    int fiberCount = 0;
+    for (ObjFiber* fiber = vm.fiber; fiber != NULL && fiberCount < FIBERS_MAX; fiber = fiber->caller) {
+        fibers[fiberCount++] = fiber;
+    }
+
+    char stack[STACK_CHARS_MAX];
+    int length = 0;
+    stack[0]   = '\0';
+    for (int i = fiberCount - 1; i >= 0; i--) {
+        // The running fiber's frame count lives in the VM until it is switched out.
+        ObjFiber* fiber = fibers[i];
+        int frameCount  = fiber == vm.fiber ? vm.frameCount : fiber->frameCount;
+        if (!appendFrames(stack, &length, fiber->frames, frameCount)) break;
+    }
+    if (length == 0) appendFrame(stack, &length, "(no Lox frame)", -1);
+
+    if (ticks > inGC) countStack(stack, ticks - inGC);
+    if (inGC > 0) {
+        appendFrame(stack, &length, "[gc]", -1);
+        countStack(stack, inGC);
+    }
+}
+
+bool writeCpuProfile(const char* path) {
+    // Whatever ran since the last safepoint: the tail of the program, or the compiler.
+    sampleCpuProfile();
+
+    FILE* file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (file == NULL) return false;
+    for (int i = 0; i < profiler.capacity; i++) {
+        Stack* entry = &profiler.stacks[i];
+        if (entry->stack != NULL) fprintf(file, "%s %lu\n", entry->stack, entry->count);
+    }
+    return file == stderr || fclose(file) == 0;
+}
@@ -0,0 +1,40 @@
+#ifndef CLOX_CPUPROF_H
+#define CLOX_CPUPROF_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+/*
+ * The CPU profiler samples where a Lox program spends its time. A SIGPROF
+ * timer, counting CPU time, ticks at the chosen rate. The signal handler
+ * only counts the tick, because the call stack is not consistent at every
+ * instruction: call() fills in a frame after counting it, growFrames()
+ * reallocates the frames, and compaction moves the functions they point to.
+ * The interpreter takes the sample at its next backward jump, call or
+ * return. Straight-line code between those never leaves the function, so
+ * the function is exact and the line is the one of the jump or call.
+ *
+ * A sample is the chain of fibers that resumed the running one, outermost
+ * first, and then their frames as "function:line". Ticks that land during
+ * a collection pause get an extra "[gc]" frame on the stack that allocated.
+ * Identical stacks are counted together, and writeCpuProfile() writes
+ * them in the folded format flamegraph.pl and speedscope read.
+ *
+ * Only the thread that calls startCpuProfile() is sampled. Threads that
+ * run no profiled Lox code call blockCpuProfileSignal() so the kernel
+ * never delivers the signal to them.
+ */
+
+// Ticks the handler counted and the interpreter has not yet sampled.
+extern _Thread_local volatile sig_atomic_t cpuProfileTicks;
+// Set during collection pauses (see pacer.c).
+extern _Thread_local volatile sig_atomic_t cpuProfileInGC;
+
+bool startCpuProfile(int hertz);
+void stopCpuProfile();
+void blockCpuProfileSignal();
+// Attribute the ticks counted so far to the running stack.
+void sampleCpuProfile();
+bool writeCpuProfile(const char* path);
+
+#endif// CLOX_CPUPROF_H
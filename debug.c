@@ -38,6 +38,27 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+static int superInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant   = chunk->bcode[offset + 1];
+    uint8_t superclass = chunk->bcode[offset + 2];
+    uint8_t site       = chunk->bcode[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (upvalue %d, site %d)\n", superclass, site);
+    return offset + 4;
+}
+
+static int superInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant   = chunk->bcode[offset + 1];
+    uint8_t argCount   = chunk->bcode[offset + 2];
+    uint8_t superclass = chunk->bcode[offset + 3];
+    uint8_t site       = chunk->bcode[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (upvalue %d, site %d)\n", superclass, site);
+    return offset + 5;
+}
+
 static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
     int constantIndx0 = chunk->bcode[offset + 1];
     int constantIndx1 = chunk->bcode[offset + 2];
@@ -108,7 +129,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return superInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GET_UPVALUE:
@@ -136,7 +157,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return superInvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->bcode[offset++];
@@ -164,6 +185,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_BUILD_STRING:
+            return byteInstruction("OP_BUILD_STRING", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compact.h"
+#include "eventloop.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define EVENTS_MAX 64
+
+typedef enum {
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_ACCEPT
+} WaitKind;
+
+/*
+ * A Waiter is the I/O a parked task is waiting to do. It sits in the waiters
+ * list while its descriptor is registered with epoll, and moves to the ready
+ * queue once the descriptor is ready; the loop then does the I/O itself and
+ * hands the result to the task.
+ */
+typedef struct Waiter {
+    ObjFiber* fiber;
+    WaitKind kind;
+    int fd;
+    int count;
+    Value data;
+    int written;
+    struct Waiter* prev;
+    struct Waiter* next;
+} Waiter;
+
+// A task that can run. Its waiter, if any, still has to do its I/O.
+typedef struct {
+    ObjFiber* fiber;
+    Waiter* waiter;
+} Ready;
+
+typedef struct {
+    double deadline;
+    unsigned long order;
+    ObjFiber* fiber;
+} Timer;
+
+/*
+ * The loop's bookkeeping lives outside the heap, like the gray stack, so
+ * scheduling never triggers a collection. Every fiber it refers to is a root.
+ *
+ * ready is a ring buffer, timers a binary min-heap ordered by deadline (ties
+ * go to the timer started first) and owner the fiber blocked in runLoop().
+ */
+typedef struct {
+    int epollFd;
+    ObjFiber* owner;
+    Ready* ready;
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+    Timer* timers;
+    int timerCount;
+    int timerCapacity;
+    unsigned long timerOrder;
+    Waiter* waiters;
+    int waiterCount;
+} EventLoop;
+
+// Every VM has a loop of its own, so the loop is thread local just like the VM.
+static _Thread_local EventLoop loop = {.epollFd = -1};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static void pushReady(ObjFiber* fiber, Waiter* waiter) {
+    if (loop.readyCount == loop.readyCapacity) {
+        int capacity = GROW_CAPACITY(loop.readyCapacity);
+        Ready* ready = malloc(sizeof(Ready) * capacity);
+        if (ready == NULL) exit(1);
+        for (int i = 0; i < loop.readyCount; i++) {
+            ready[i] = loop.ready[(loop.readyHead + i) % loop.readyCapacity];
+        }
+        free(loop.ready);
+        loop.ready         = ready;
+        loop.readyHead     = 0;
+        loop.readyCapacity = capacity;
+    }
+
+    Ready* slot  = &loop.ready[(loop.readyHead + loop.readyCount) % loop.readyCapacity];
+    slot->fiber  = fiber;
+    slot->waiter = waiter;
+    loop.readyCount++;
+}
+
+static bool timerBefore(Timer* a, Timer* b) {
+    if (a->deadline != b->deadline) return a->deadline < b->deadline;
+    return a->order < b->order;
+}
+
+static void swapTimers(int a, int b) {
+    Timer timer    = loop.timers[a];
+    loop.timers[a] = loop.timers[b];
+    loop.timers[b] = timer;
+}
+
+static void addTimer(double deadline, ObjFiber* fiber) {
+    if (loop.timerCount == loop.timerCapacity) {
+        loop.timerCapacity = GROW_CAPACITY(loop.timerCapacity);
+        loop.timers        = realloc(loop.timers, sizeof(Timer) * loop.timerCapacity);
+        if (loop.timers == NULL) exit(1);
+    }
+
+    int index       = loop.timerCount++;
+    Timer* timer    = &loop.timers[index];
+    timer->deadline = deadline;
+    timer->order    = loop.timerOrder++;
+    timer->fiber    = fiber;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!timerBefore(&loop.timers[index], &loop.timers[parent])) break;
+        swapTimers(index, parent);
+        index = parent;
+    }
+}
+
+static ObjFiber* popTimer() {
+    ObjFiber* fiber = loop.timers[0].fiber;
+    loop.timers[0]  = loop.timers[--loop.timerCount];
+
+    int index = 0;
+    for (;;) {
+        int smallest = index;
+        int left     = index * 2 + 1;
+        int right    = left + 1;
+        if (left < loop.timerCount && timerBefore(&loop.timers[left], &loop.timers[smallest])) smallest = left;
+        if (right < loop.timerCount && timerBefore(&loop.timers[right], &loop.timers[smallest])) smallest = right;
+        if (smallest == index) break;
+        swapTimers(index, smallest);
+        index = smallest;
+    }
+    return fiber;
+}
+
+static Waiter* newWaiter(WaitKind kind, int fd) {
+    Waiter* waiter = malloc(sizeof(Waiter));
+    if (waiter == NULL) exit(1);
+    waiter->fiber   = vm.fiber;
+    waiter->kind    = kind;
+    waiter->fd      = fd;
+    waiter->count   = 0;
+    waiter->data    = NIL_VAL;
+    waiter->written = 0;
+    waiter->prev    = NULL;
+    waiter->next    = NULL;
+    return waiter;
+}
+
+static short waiterEvents(Waiter* waiter) {
+    return waiter->kind == WAIT_WRITE ? POLLOUT : POLLIN;
+}
+
+// Register a waiter with epoll. Only one task can wait on a descriptor at a time.
+static bool watch(Waiter* waiter) {
+    if (loop.epollFd < 0) {
+        loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop.epollFd < 0) return false;
+    }
+
+    struct epoll_event event;
+    event.events   = waiter->kind == WAIT_WRITE ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = waiter;
+    if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, waiter->fd, &event) < 0) return false;
+
+    waiter->prev = NULL;
+    waiter->next = loop.waiters;
+    if (loop.waiters != NULL) loop.waiters->prev = waiter;
+    loop.waiters = waiter;
+    loop.waiterCount++;
+    return true;
+}
+
+static void unwatch(Waiter* waiter) {
+    epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, waiter->fd, NULL);
+    if (waiter->prev != NULL) {
+        waiter->prev->next = waiter->next;
+    } else {
+        loop.waiters = waiter->next;
+    }
+    if (waiter->next != NULL) waiter->next->prev = waiter->prev;
+    loop.waiterCount--;
+}
+
+static bool wouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * Do a waiter's I/O without blocking. Returns false if the descriptor is not
+ * ready after all, or a write has more left to go.
+ */
+static bool tryWait(Waiter* waiter, Value* result) {
+    switch (waiter->kind) {
+        case WAIT_READ: {
+            char* buffer = malloc(waiter->count);
+            if (buffer == NULL) exit(1);
+            ssize_t count = read(waiter->fd, buffer, waiter->count);
+            if (count < 0 && wouldBlock()) {
+                free(buffer);
+                return false;
+            }
+            if (count > 0) {
+                ObjString* string = allocateString((int) count);
+                memcpy(string->chars, buffer, count);
+                *result = OBJ_VAL(finishString(string));
+            } else {
+                *result = NIL_VAL;
+            }
+            free(buffer);
+            return true;
+        }
+        case WAIT_WRITE: {
+            ObjString* string = AS_STRING(waiter->data);
+            while (waiter->written < string->length) {
+                ssize_t count = write(waiter->fd, string->chars + waiter->written,
+                                      string->length - waiter->written);
+                if (count < 0) {
+                    if (wouldBlock()) return false;
+                    *result = NIL_VAL;
+                    return true;
+                }
+                waiter->written += (int) count;
+            }
+            *result = NUMBER_VAL(waiter->written);
+            return true;
+        }
+        case WAIT_ACCEPT: {
+            int fd = accept4(waiter->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0 && wouldBlock()) return false;
+            *result = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool pollFd(int fd, short events, int timeout) {
+    struct pollfd pollFd = {fd, events, 0};
+    int count;
+    do {
+        count = poll(&pollFd, 1, timeout);
+    } while (count < 0 && errno == EINTR);
+    return count != 0;
+}
+
+static Value park(int argCount) {
+    vm.stackTop -= argCount + 1;
+    vm.fiber->state = FIBER_SUSPENDED;
+    runNextTask();
+    return NIL_VAL;
+}
+
+/*
+ * Finish the I/O a native asked for. A task whose descriptor is not ready is
+ * parked until it is; any other fiber blocks the thread.
+ */
+static Value await(Waiter* waiter, int argCount) {
+    Value result = NIL_VAL;
+    if (!vm.fiber->isTask) {
+        do {
+            pollFd(waiter->fd, waiterEvents(waiter), -1);
+        } while (!tryWait(waiter, &result));
+        free(waiter);
+        return result;
+    }
+
+    if (pollFd(waiter->fd, waiterEvents(waiter), 0) && tryWait(waiter, &result)) {
+        free(waiter);
+        return result;
+    }
+    if (!watch(waiter)) {
+        int error = errno;
+        int fd    = waiter->fd;
+        free(waiter);
+        if (error == EEXIST) {
+            runtimeError("Another task is already waiting on descriptor %d.", fd);
+        } else {
+            runtimeError("Cannot wait on descriptor %d: %s.", fd, strerror(error));
+        }
+        return NIL_VAL;
+    }
+    return park(argCount);
+}
+
+// Block until a waiter's descriptor is ready or a timer is due.
+static void waitForEvents() {
+    int timeout = -1;
+    if (loop.timerCount > 0) {
+        // Round up, so that the wait never ends before the timer is due.
+        double delay = (loop.timers[0].deadline - now()) * 1000;
+        timeout      = delay > 0 ? (int) delay + 1 : 0;
+    }
+
+    struct epoll_event events[EVENTS_MAX];
+    int count = 0;
+    if (loop.waiterCount > 0) {
+        count = epoll_wait(loop.epollFd, events, EVENTS_MAX, timeout);
+        if (count < 0) count = 0;
+    } else {
+        poll(NULL, 0, timeout);
+    }
+
+    for (int i = 0; i < count; i++) {
+        Waiter* waiter = events[i].data.ptr;
+        unwatch(waiter);
+        pushReady(waiter->fiber, waiter);
+    }
+
+    double time = now();
+    while (loop.timerCount > 0 && loop.timers[0].deadline <= time) {
+        pushReady(popTimer(), NULL);
+    }
+}
+
+void runNextTask() {
+    for (;;) {
+        if (loop.readyCount > 0) {
+            // The entry stays queued, and so rooted, while its I/O allocates the result.
+            Ready next     = loop.ready[loop.readyHead];
+            Value result   = NIL_VAL;
+            bool done      = next.waiter == NULL || tryWait(next.waiter, &result);
+            loop.readyHead = (loop.readyHead + 1) % loop.readyCapacity;
+            loop.readyCount--;
+            // Woken early, or a write only got partway: wait some more.
+            if (!done && watch(next.waiter)) continue;
+
+            free(next.waiter);
+            enterFiber(next.fiber, result);
+            return;
+        }
+
+        if (loop.waiterCount == 0 && loop.timerCount == 0) {
+            // Every task has finished, so runLoop() returns.
+            ObjFiber* owner = loop.owner;
+            loop.owner      = NULL;
+            enterFiber(owner, NIL_VAL);
+            return;
+        }
+
+        waitForEvents();
+    }
+}
+
+void yieldTask() {
+    pushReady(vm.fiber, NULL);
+    vm.fiber->state = FIBER_SUSPENDED;
+    runNextTask();
+}
+
+static bool isDescriptor(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0;
+}
+
+Value taskNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity != 0) {
+        runtimeError("task() expects a function that takes no arguments.");
+        return NIL_VAL;
+    }
+
+    ObjFiber* fiber = newFiber(AS_CLOSURE(args[0]), FIBER_STACK_MIN, FIBER_FRAMES_MIN);
+    fiber->isTask   = true;
+    pushReady(fiber, NULL);
+    return OBJ_VAL(fiber);
+}
+
+Value runLoopNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError("runLoop() takes no arguments.");
+        return NIL_VAL;
+    }
+    if (vm.fiber->isTask) {
+        runtimeError("Cannot run the event loop from a task.");
+        return NIL_VAL;
+    }
+    if (loop.owner != NULL) {
+        runtimeError("The event loop is already running.");
+        return NIL_VAL;
+    }
+    if (loop.readyCount == 0 && loop.waiterCount == 0 && loop.timerCount == 0) return NIL_VAL;
+
+    // The owner gets its result pushed once the last task is done.
+    vm.stackTop -= argCount + 1;
+    loop.owner = vm.fiber;
+    runNextTask();
+    return NIL_VAL;
+}
+
+Value sleepNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+        runtimeError("sleep() expects a number of milliseconds.");
+        return NIL_VAL;
+    }
+
+    double milliseconds = AS_NUMBER(args[0]);
+    if (!vm.fiber->isTask) {
+        struct timespec delay;
+        delay.tv_sec  = (time_t) (milliseconds / 1000);
+        delay.tv_nsec = (long) ((milliseconds - (double) delay.tv_sec * 1000) * 1000000);
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {}
+        return NIL_VAL;
+    }
+
+    addTimer(now() + milliseconds / 1000, vm.fiber);
+    return park(argCount);
+}
+
+Value openNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_STRING(args[0]) ||
+        (argCount == 2 && !IS_STRING(args[1]))) {
+        runtimeError("open() expects a path and an optional mode.");
+        return NIL_VAL;
+    }
+    // The system wants C strings, which views are not.
+    for (int i = 0; i < argCount; i++) {
+        args[i] = OBJ_VAL(ownString(AS_STRING(args[i])));
+    }
+
+    int flags = O_RDONLY;
+    if (argCount == 2) {
+        const char* mode = AS_CSTRING(args[1]);
+        if (strcmp(mode, "w") == 0) {
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (strcmp(mode, "a") == 0) {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        } else if (strcmp(mode, "r") != 0) {
+            runtimeError("Unknown open() mode '%s'.", mode);
+            return NIL_VAL;
+        }
+    }
+
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    return fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+}
+
+Value readNative(int argCount, Value* args) {
+    if (argCount != 2 || !isDescriptor(args[0]) || !IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1) {
+        runtimeError("read() expects a descriptor and a byte count.");
+        return NIL_VAL;
+    }
+
+    Waiter* waiter = newWaiter(WAIT_READ, (int) AS_NUMBER(args[0]));
+    waiter->count  = (int) AS_NUMBER(args[1]);
+    return await(waiter, argCount);
+}
+
+Value writeNative(int argCount, Value* args) {
+    if (argCount != 2 || !isDescriptor(args[0]) || !IS_STRING(args[1])) {
+        runtimeError("write() expects a descriptor and a string.");
+        return NIL_VAL;
+    }
+
+    Waiter* waiter = newWaiter(WAIT_WRITE, (int) AS_NUMBER(args[0]));
+    waiter->data   = args[1];
+    return await(waiter, argCount);
+}
+
+Value closeNative(int argCount, Value* args) {
+    if (argCount != 1 || !isDescriptor(args[0])) {
+        runtimeError("close() expects a descriptor.");
+        return NIL_VAL;
+    }
+
+    // A task still waiting on the descriptor wakes up to find it closed.
+    int fd = (int) AS_NUMBER(args[0]);
+    for (Waiter* waiter = loop.waiters; waiter != NULL; waiter = waiter->next) {
+        if (waiter->fd == fd) {
+            unwatch(waiter);
+            pushReady(waiter->fiber, waiter);
+            break;
+        }
+    }
+    close(fd);
+    return NIL_VAL;
+}
+
+static bool socketAddress(Value path, struct sockaddr_un* address) {
+    ObjString* string = AS_STRING(path);
+    if (string->length >= (int) sizeof(address->sun_path)) {
+        runtimeError("Socket path is too long.");
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, string->chars, string->length);
+    // A peer that hangs up should make write() fail, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+Value listenNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) {
+        runtimeError("listen() expects a socket path.");
+        return NIL_VAL;
+    }
+
+    struct sockaddr_un address;
+    if (!socketAddress(args[0], &address)) return NIL_VAL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NIL_VAL;
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return NIL_VAL;
+    }
+    return NUMBER_VAL(fd);
+}
+
+Value acceptNative(int argCount, Value* args) {
+    if (argCount != 1 || !isDescriptor(args[0])) {
+        runtimeError("accept() expects a listening descriptor.");
+        return NIL_VAL;
+    }
+
+    return await(newWaiter(WAIT_ACCEPT, (int) AS_NUMBER(args[0])), argCount);
+}
+
+Value connectNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) {
+        runtimeError("connect() expects a socket path.");
+        return NIL_VAL;
+    }
+
+    struct sockaddr_un address;
+    if (!socketAddress(args[0], &address)) return NIL_VAL;
+    // Connecting to a Unix domain socket only blocks while the listener's
+    // backlog is full, so the socket goes non-blocking afterwards.
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NIL_VAL;
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(fd);
+        return NIL_VAL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return NUMBER_VAL(fd);
+}
+
+void markEventLoop() {
+    markObject((Obj*) loop.owner);
+    for (int i = 0; i < loop.readyCount; i++) {
+        Ready* ready = &loop.ready[(loop.readyHead + i) % loop.readyCapacity];
+        markObject((Obj*) ready->fiber);
+        if (ready->waiter != NULL) markValue(ready->waiter->data);
+    }
+    for (int i = 0; i < loop.timerCount; i++) {
+        markObject((Obj*) loop.timers[i].fiber);
+    }
+    for (Waiter* waiter = loop.waiters; waiter != NULL; waiter = waiter->next) {
+        markObject((Obj*) waiter->fiber);
+        markValue(waiter->data);
+    }
+}
+
+// Rewrite the loop's references after compaction moved the heap (see compact.h).
+void forwardEventLoop() {
+    loop.owner = (ObjFiber*) forwardObject((Obj*) loop.owner);
+    for (int i = 0; i < loop.readyCount; i++) {
+        Ready* ready = &loop.ready[(loop.readyHead + i) % loop.readyCapacity];
+        ready->fiber = (ObjFiber*) forwardObject((Obj*) ready->fiber);
+        if (ready->waiter != NULL) {
+            ready->waiter->fiber = (ObjFiber*) forwardObject((Obj*) ready->waiter->fiber);
+            ready->waiter->data  = forwardValue(ready->waiter->data);
+        }
+    }
+    for (int i = 0; i < loop.timerCount; i++) {
+        loop.timers[i].fiber = (ObjFiber*) forwardObject((Obj*) loop.timers[i].fiber);
+    }
+    for (Waiter* waiter = loop.waiters; waiter != NULL; waiter = waiter->next) {
+        waiter->fiber = (ObjFiber*) forwardObject((Obj*) waiter->fiber);
+        waiter->data  = forwardValue(waiter->data);
+    }
+}
+
+void resetEventLoop() {
+    // Closing the epoll instance drops every registration with it.
+    if (loop.epollFd >= 0) {
+        close(loop.epollFd);
+        loop.epollFd = -1;
+    }
+    while (loop.waiters != NULL) {
+        Waiter* next = loop.waiters->next;
+        free(loop.waiters);
+        loop.waiters = next;
+    }
+    for (int i = 0; i < loop.readyCount; i++) {
+        free(loop.ready[(loop.readyHead + i) % loop.readyCapacity].waiter);
+    }
+
+    loop.owner       = NULL;
+    loop.readyHead   = 0;
+    loop.readyCount  = 0;
+    loop.timerCount  = 0;
+    loop.waiterCount = 0;
+}
+
+void freeEventLoop() {
+    resetEventLoop();
+    free(loop.ready);
+    free(loop.timers);
+    loop.ready         = NULL;
+    loop.readyCapacity = 0;
+    loop.timers        = NULL;
+    loop.timerCapacity = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef CLOX_EVENTLOOP_H
+#define CLOX_EVENTLOOP_H
+
+#include "value.h"
+
+/*
+ * The event loop runs tasks: fibers that are scheduled by the VM instead of
+ * being resumed by hand. When a task calls an I/O native that would block, or
+ * sleep(), the task is parked and the next ready task runs; epoll tells the
+ * loop when a parked task can go on. yield() inside a task lets the other
+ * ready tasks run first. Outside of a task the same natives simply block.
+ *
+ * Descriptors are numbers. The ones opened here are non-blocking; any other
+ * descriptor (0, 1 and 2 for instance) is used as it is.
+ *
+ * task(fn)             schedule fn on a new fiber, returns the fiber
+ * runLoop()            run tasks until every one of them has finished
+ * sleep(ms)
+ * open(path, mode)     mode is "r" (the default), "w" or "a"
+ * read(fd, max)        returns a string, or nil at the end of the input
+ * write(fd, string)    returns the number of bytes written
+ * close(fd)
+ * listen(path)         listen on a Unix domain socket
+ * accept(fd)           returns the descriptor of the next connection
+ * connect(path)        connect to a Unix domain socket
+ *
+ * open, read, write, listen, accept and connect return nil when the system
+ * call fails.
+ */
+Value taskNative(int argCount, Value* args);
+Value runLoopNative(int argCount, Value* args);
+Value sleepNative(int argCount, Value* args);
+Value openNative(int argCount, Value* args);
+Value readNative(int argCount, Value* args);
+Value writeNative(int argCount, Value* args);
+Value closeNative(int argCount, Value* args);
+Value listenNative(int argCount, Value* args);
+Value acceptNative(int argCount, Value* args);
+Value connectNative(int argCount, Value* args);
+
+// Switch to the next task that can run, waiting for one if none can.
+void runNextTask();
+// Put the running task at the back of the ready queue and run the next one.
+void yieldTask();
+
+void markEventLoop();
+void forwardEventLoop();
+// Drop every task without running it.
+void resetEventLoop();
+void freeEventLoop();
+
+#endif// CLOX_EVENTLOOP_H
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gcstats.h"
+#include "vm.h"
+
+_Thread_local GCStats gcStats;
+static _Thread_local double sweepStart;
+// Sweeping done in the pause that is running.
+static _Thread_local double pauseSweep;
+
+const char* const objTypeNames[OBJ_TYPE_COUNT] = {
+        [OBJ_BOUND_METHOD] = "boundMethod",
+        [OBJ_CLASS]        = "class",
+        [OBJ_CLOSURE]      = "closure",
+        [OBJ_FIBER]        = "fiber",
+        [OBJ_FUNCTION]     = "function",
+        [OBJ_INSTANCE]     = "instance",
+        [OBJ_LIST]         = "list",
+        [OBJ_NATIVE]       = "native",
+        [OBJ_ROPE]         = "rope",
+        [OBJ_STRING]       = "string",
+        [OBJ_UPVALUE]      = "upvalue",
+};
+
+void initGCStats() {
+    gcStats    = (GCStats){0};
+    pauseSweep = 0;
+}
+
+double gcClock() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+void beginSweep() {
+    sweepStart = gcClock();
+}
+
+void endSweep() {
+    pauseSweep += gcClock() - sweepStart;
+}
+
+void recordPause(double seconds) {
+    int bucket = 0;
+    for (double micros = seconds * 1e6; bucket < PAUSE_BUCKETS - 1 && micros >= (double) (1ul << bucket); bucket++);
+    gcStats.pauses[bucket]++;
+
+    gcStats.markTime += seconds - pauseSweep;
+    gcStats.sweepTime += pauseSweep;
+    gcStats.pauseTime += seconds;
+    if (seconds > gcStats.maxPause) gcStats.maxPause = seconds;
+    pauseSweep = 0;
+}
+
+static void bucketName(int bucket, char* name, size_t size) {
+    if (bucket == PAUSE_BUCKETS - 1) {
+        snprintf(name, size, "longer");
+    } else {
+        snprintf(name, size, "under%luus", 1ul << bucket);
+    }
+}
+
+bool writeGCStats(const char* path) {
+    FILE* file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "{\n  \"collections\": %lu,\n", gcStats.collections);
+    fprintf(file, "  \"heapBytes\": %zu,\n  \"nextGC\": %zu,\n", vm.bytesAllocated, vm.nextGC);
+    fprintf(file, "  \"bytesAllocated\": %zu,\n  \"bytesFreed\": %zu,\n", gcStats.bytesAllocated, gcStats.bytesFreed);
+    fprintf(file, "  \"peakHeapBytes\": %zu,\n", gcStats.peakHeap);
+    fprintf(file, "  \"markSeconds\": %.6f,\n  \"sweepSeconds\": %.6f,\n", gcStats.markTime, gcStats.sweepTime);
+    fprintf(file, "  \"pauseSeconds\": %.6f,\n  \"maxPauseSeconds\": %.6f,\n", gcStats.pauseTime, gcStats.maxPause);
+
+    fprintf(file, "  \"types\": {\n");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(file, "    \"%s\": {\"allocated\": %zu, \"freed\": %zu, \"live\": %zu}%s\n", objTypeNames[type],
+                gcStats.typeAllocated[type], gcStats.typeFreed[type], gcStats.typeLive[type],
+                type < OBJ_TYPE_COUNT - 1 ? "," : "");
+    }
+    fprintf(file, "  },\n  \"pauses\": {\n");
+    for (int bucket = 0; bucket < PAUSE_BUCKETS; bucket++) {
+        char name[32];
+        bucketName(bucket, name, sizeof(name));
+        fprintf(file, "    \"%s\": %lu%s\n", name, gcStats.pauses[bucket], bucket < PAUSE_BUCKETS - 1 ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+
+    return file == stderr || fclose(file) == 0;
+}
+
+// An instance of a class of its own, left on the stack so that it stays alive.
+static ObjInstance* pushRecord(const char* className) {
+    push(OBJ_VAL(copyString(className, (int) strlen(className))));
+    ObjClass* class = newClass(AS_STRING(vm.stackTop[-1]));
+    push(OBJ_VAL(class));
+    ObjInstance* instance = newInstance(class);
+    pop();
+    pop();
+    push(OBJ_VAL(instance));
+    return instance;
+}
+
+static void setField(ObjInstance* instance, const char* name, Value value) {
+    push(value);
+    push(OBJ_VAL(copyString(name, (int) strlen(name))));
+    tableSet(&instance->fields, AS_STRING(vm.stackTop[-1]), value);
+    pop();
+    pop();
+}
+
+Value gcStatsNative(int argCount, Value* args) {
+    // Building the result allocates, so take the numbers first.
+    GCStats stats = gcStats;
+    size_t heap   = vm.bytesAllocated;
+    size_t nextGC = vm.nextGC;
+
+    ObjInstance* result = pushRecord("GCStats");
+    setField(result, "collections", NUMBER_VAL((double) stats.collections));
+    setField(result, "heapBytes", NUMBER_VAL((double) heap));
+    setField(result, "nextGC", NUMBER_VAL((double) nextGC));
+    setField(result, "bytesAllocated", NUMBER_VAL((double) stats.bytesAllocated));
+    setField(result, "bytesFreed", NUMBER_VAL((double) stats.bytesFreed));
+    setField(result, "peakHeapBytes", NUMBER_VAL((double) stats.peakHeap));
+    setField(result, "markSeconds", NUMBER_VAL(stats.markTime));
+    setField(result, "sweepSeconds", NUMBER_VAL(stats.sweepTime));
+    setField(result, "pauseSeconds", NUMBER_VAL(stats.pauseTime));
+    setField(result, "maxPauseSeconds", NUMBER_VAL(stats.maxPause));
+
+    ObjInstance* types = pushRecord("GCTypeStats");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        ObjInstance* counts = pushRecord("GCTypeCounts");
+        setField(counts, "allocated", NUMBER_VAL((double) stats.typeAllocated[type]));
+        setField(counts, "freed", NUMBER_VAL((double) stats.typeFreed[type]));
+        setField(counts, "live", NUMBER_VAL((double) stats.typeLive[type]));
+        setField(types, objTypeNames[type], OBJ_VAL(counts));
+        pop();
+    }
+    setField(result, "types", OBJ_VAL(types));
+    pop();
+
+    ObjInstance* pauses = pushRecord("GCPauses");
+    for (int bucket = 0; bucket < PAUSE_BUCKETS; bucket++) {
+        char name[32];
+        bucketName(bucket, name, sizeof(name));
+        setField(pauses, name, NUMBER_VAL((double) stats.pauses[bucket]));
+    }
+    setField(result, "pauses", OBJ_VAL(pauses));
+    pop();
+
+    return pop();
+}
@@ -0,0 +1,59 @@
+#ifndef CLOX_GCSTATS_H
+#define CLOX_GCSTATS_H
+
+#include "object.h"
+
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+// Pause buckets: bucket i counts pauses shorter than 2^i microseconds, the last one the rest.
+#define PAUSE_BUCKETS 25
+
+/*
+ * Collector telemetry, kept by every VM whatever the build. The counters
+ * are plain additions on paths that already do more work than that.
+ *
+ * bytesAllocated and bytesFreed cover every reallocate(); the per-type
+ * counters cover the objects themselves, not the arrays they own. peakHeap
+ * is the most vm.bytesAllocated has been. Pauses are the times the program
+ * is stopped (a concurrent cycle has two), split into marking and sweeping.
+ *
+ * gcStats() hands a snapshot to Lox as an instance, and --gc-stats writes
+ * one as JSON when the main VM exits.
+ */
+typedef struct {
+    unsigned long collections;
+    size_t bytesAllocated;
+    size_t bytesFreed;
+    size_t peakHeap;
+    size_t typeAllocated[OBJ_TYPE_COUNT];
+    size_t typeFreed[OBJ_TYPE_COUNT];
+    size_t typeLive[OBJ_TYPE_COUNT];
+    unsigned long pauses[PAUSE_BUCKETS];
+    double markTime;
+    double sweepTime;
+    double pauseTime;
+    double maxPause;
+} GCStats;
+
+extern _Thread_local GCStats gcStats;
+extern const char* const objTypeNames[OBJ_TYPE_COUNT];
+
+static inline void countAllocation(ObjType type, size_t size) {
+    gcStats.typeAllocated[type] += size;
+    gcStats.typeLive[type]++;
+}
+
+static inline void countFree(ObjType type, size_t size) {
+    gcStats.typeFreed[type] += size;
+    gcStats.typeLive[type]--;
+}
+
+void initGCStats();
+double gcClock();
+void beginSweep();
+void endSweep();
+// Count a pause; whatever part of it was not sweeping was marking.
+void recordPause(double seconds);
+bool writeGCStats(const char* path);
+Value gcStatsNative(int argCount, Value* args);
+
+#endif// CLOX_GCSTATS_H
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcstats.h"
+#include "heapprof.h"
+#include "vm.h"
+
+// Obj.profileSite is 16 bits and 0 means not sampled.
+#define SITES_MAX (UINT16_MAX - 1)
+// The type of a site that allocates arrays.
+#define ARRAY_SITE OBJ_TYPE_COUNT
+
+typedef struct {
+    // A copy: the function's name may move or die before the report.
+    char* function;
+    int line;
+    int type;
+    size_t allocatedBytes;
+    size_t liveBytes;
+    unsigned long samples;
+} Site;
+
+typedef struct {
+    size_t sampleRate;
+    // Bytes to go before the next sample.
+    size_t untilSample;
+    uint64_t random;
+    FILE* report;
+    bool reportEveryGC;
+    unsigned long collections;
+    Site* sites;
+    int siteCount;
+    int siteCapacity;
+    // Open addressing over sites: the site's number, or 0 for an empty slot.
+    uint16_t* index;
+    int indexCapacity;
+} HeapProfiler;
+
+_Thread_local bool heapProfiling = false;
+static _Thread_local HeapProfiler profiler;
+
+// xorshift64*, plenty for spreading samples out.
+static uint64_t nextRandom() {
+    profiler.random ^= profiler.random >> 12;
+    profiler.random ^= profiler.random << 25;
+    profiler.random ^= profiler.random >> 27;
+    return profiler.random * 2685821657736338717ull;
+}
+
+// Uniform between 1 and twice the rate, so the average gap is the rate.
+static size_t nextGap() {
+    return 1 + nextRandom() % (2 * profiler.sampleRate);
+}
+
+void startHeapProfile(size_t sampleRate, FILE* report, bool reportEveryGC) {
+    stopHeapProfile();
+    profiler.sampleRate    = sampleRate > 0 ? sampleRate : 1;
+    profiler.random        = 0x9E3779B97F4A7C15ull ^ (uintptr_t) &profiler;
+    profiler.untilSample   = nextGap();
+    profiler.report        = report;
+    profiler.reportEveryGC = reportEveryGC;
+    heapProfiling          = true;
+}
+
+void stopHeapProfile() {
+    for (int i = 0; i < profiler.siteCount; i++) {
+        free(profiler.sites[i].function);
+    }
+    free(profiler.sites);
+    free(profiler.index);
+    profiler      = (HeapProfiler){0};
+    heapProfiling = false;
+}
+
+static uint32_t hashSite(const char* function, int line, int type) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = function; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t) line) * 16777619u;
+    return (hash ^ (uint32_t) type) * 16777619u;
+}
+
+static void growIndex() {
+    int capacity    = profiler.indexCapacity == 0 ? 64 : profiler.indexCapacity * 2;
+    uint16_t* index = calloc(capacity, sizeof(uint16_t));
+    if (index == NULL) exit(1);
+    for (int i = 0; i < profiler.siteCount; i++) {
+        Site* site    = &profiler.sites[i];
+        uint32_t slot = hashSite(site->function, site->line, site->type) & (capacity - 1);
+        while (index[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        index[slot] = (uint16_t) (i + 1);
+    }
+    free(profiler.index);
+    profiler.index         = index;
+    profiler.indexCapacity = capacity;
+}
+
+// The number of the site allocating right now, adding it if it is new.
+static int currentSite(int type) {
+    const char* function = "(no Lox frame)";
+    int line             = 0;
+    if (vm.frameCount > 0) {
+        CallFrame* frame = &vm.frames[vm.frameCount - 1];
+        Chunk* chunk     = &frame->closure->function->chunk;
+        ObjString* name  = frame->closure->function->name;
+        function         = name == NULL ? "script" : name->chars;
+        // ip is past the instruction running, unless the frame has not started yet.
+        line = chunk->lines[frame->ip > chunk->bcode ? frame->ip - chunk->bcode - 1 : 0];
+    }
+
+    if (profiler.siteCount * 2 >= profiler.indexCapacity) growIndex();
+    uint32_t slot = hashSite(function, line, type) & (profiler.indexCapacity - 1);
+    while (profiler.index[slot] != 0) {
+        Site* site = &profiler.sites[profiler.index[slot] - 1];
+        if (site->line == line && site->type == type && strcmp(site->function, function) == 0) {
+            return profiler.index[slot];
+        }
+        slot = (slot + 1) & (profiler.indexCapacity - 1);
+    }
+
+    // Once every number is taken, new sites are lumped in with the last one.
+    if (profiler.siteCount == SITES_MAX) return SITES_MAX;
+    if (profiler.siteCount == profiler.siteCapacity) {
+        profiler.siteCapacity = profiler.siteCapacity < 8 ? 8 : profiler.siteCapacity * 2;
+        profiler.sites        = realloc(profiler.sites, sizeof(Site) * profiler.siteCapacity);
+        if (profiler.sites == NULL) exit(1);
+    }
+    Site* site = &profiler.sites[profiler.siteCount++];
+    *site      = (Site){.function = strdup(function), .line = line, .type = type};
+    if (site->function == NULL) exit(1);
+    profiler.index[slot] = (uint16_t) profiler.siteCount;
+    return profiler.siteCount;
+}
+
+static size_t sampleWeight(size_t size) {
+    return size > profiler.sampleRate ? size : profiler.sampleRate;
+}
+
+void sampleAllocation(Obj* object, size_t size) {
+    if (size < profiler.untilSample) {
+        profiler.untilSample -= size;
+        return;
+    }
+    profiler.untilSample = nextGap();
+
+    int number   = currentSite(object == NULL ? ARRAY_SITE : (int) object->type);
+    Site* site   = &profiler.sites[number - 1];
+    size_t bytes = sampleWeight(size);
+    site->allocatedBytes += bytes;
+    site->samples++;
+    if (object != NULL) {
+        object->profileSite = (uint16_t) number;
+        site->liveBytes += bytes;
+    }
+}
+
+void releaseSample(Obj* object, size_t size) {
+    // Sampled by a profile that has been stopped since.
+    if (object->profileSite > profiler.siteCount) return;
+    profiler.sites[object->profileSite - 1].liveBytes -= sampleWeight(size);
+}
+
+void heapProfileCollected() {
+    profiler.collections++;
+    if (profiler.reportEveryGC) {
+        char when[64];
+        snprintf(when, sizeof(when), "after collection %lu", profiler.collections);
+        writeHeapProfile(when);
+    }
+}
+
+static int compareSites(const void* a, const void* b) {
+    const Site* left  = *(const Site**) a;
+    const Site* right = *(const Site**) b;
+    if (left->liveBytes != right->liveBytes) return left->liveBytes < right->liveBytes ? 1 : -1;
+    if (left->allocatedBytes != right->allocatedBytes) return left->allocatedBytes < right->allocatedBytes ? 1 : -1;
+    return 0;
+}
+
+void writeHeapProfile(const char* when) {
+    if (!heapProfiling || profiler.report == NULL) return;
+
+    Site** sites = malloc(sizeof(Site*) * (profiler.siteCount + 1));
+    if (sites == NULL) exit(1);
+    size_t live      = 0;
+    size_t allocated = 0;
+    for (int i = 0; i < profiler.siteCount; i++) {
+        sites[i] = &profiler.sites[i];
+        live += sites[i]->liveBytes;
+        allocated += sites[i]->allocatedBytes;
+    }
+    qsort(sites, profiler.siteCount, sizeof(Site*), compareSites);
+
+    FILE* report = profiler.report;
+    fprintf(report, "# heap profile %s: one sample per %zu bytes, %zu live, %zu allocated\n", when,
+            profiler.sampleRate, live, allocated);
+    fprintf(report, "# %12s %14s %8s  %-12s %s\n", "live bytes", "alloc bytes", "samples", "type", "site");
+    for (int i = 0; i < profiler.siteCount; i++) {
+        Site* site       = sites[i];
+        const char* type = site->type == ARRAY_SITE ? "array" : objTypeNames[site->type];
+        fprintf(report, "%14zu %14zu %8lu  %-12s %s line %d\n", site->liveBytes, site->allocatedBytes,
+                site->samples, type, site->function, site->line);
+    }
+    fprintf(report, "\n");
+    fflush(report);
+    free(sites);
+}
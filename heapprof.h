@@ -0,0 +1,36 @@
+#ifndef CLOX_HEAPPROF_H
+#define CLOX_HEAPPROF_H
+
+#include <stdio.h>
+
+#include "object.h"
+
+/*
+ * The heap profiler attributes allocations to the Lox code making them: the
+ * function and line of the innermost CallFrame, for objects from
+ * allocateObj() and arrays from ALLOCATE(). A site is a function, a line and
+ * what was allocated: an ObjType, or an array.
+ *
+ * It samples by bytes. On average one allocation in every sampleRate bytes
+ * is picked, at random so that allocation patterns cannot line up with it,
+ * and stands for sampleRate bytes (or its own size, if bigger). A sampled
+ * object carries its site in Obj.profileSite, which compaction moves along
+ * with it, and takes its bytes off the site's live count when it is freed.
+ * Arrays are only counted when allocated.
+ *
+ * Each VM profiles on its own, from startHeapProfile() on.
+ */
+
+// Whether the VM on this thread is profiling; checked before anything else is done.
+extern _Thread_local bool heapProfiling;
+
+void startHeapProfile(size_t sampleRate, FILE* report, bool reportEveryGC);
+void stopHeapProfile();
+// object is NULL for an array.
+void sampleAllocation(Obj* object, size_t size);
+void releaseSample(Obj* object, size_t size);
+// Called after every collection; writes a report if asked to.
+void heapProfileCollected();
+void writeHeapProfile(const char* when);
+
+#endif// CLOX_HEAPPROF_H
@@ -0,0 +1,701 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpuprof.h"
+#include "gcstats.h"
+#include "isolate.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define ISOLATE_THREADS_MIN 2
+
+/*
+ * A Packet holds a value serialized out of one heap so that it can be rebuilt
+ * in another. Packets live outside of every VM heap, so they are managed with
+ * plain malloc()/free() instead of reallocate().
+ */
+typedef struct {
+    int count;
+    int capacity;
+    int read;
+    uint8_t* bytes;
+} Packet;
+
+typedef enum {
+    PACK_NIL,
+    PACK_FALSE,
+    PACK_TRUE,
+    PACK_NUMBER,
+    PACK_STRING,
+    // A method or property name: selectors are per VM, so the receiver assigns its own.
+    PACK_SELECTOR,
+    PACK_FUNCTION,
+    PACK_CLOSURE,
+} PackTag;
+
+typedef struct Isolate {
+    char* source;// script source, or NULL when spawning a function
+    Packet callee;
+    Packet args;
+    int argCount;
+    Packet result;
+#ifdef CLOX_BENCH
+    // What the isolate's VM counted, handed to the VM that joins it.
+    unsigned long instructions;
+    size_t peakHeap;
+#endif
+    bool done;
+    bool joined;
+    struct Isolate* next;// next in the run queue
+} Isolate;
+
+typedef struct Message {
+    Packet packet;
+    struct Message* next;
+} Message;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Message* head;
+    Message* tail;
+    bool closed;// guarded by lock
+    int users;  // natives between findChannel() and releaseChannel(), guarded by poolLock
+} Channel;
+
+// poolLock guards the run queue, the isolate and channel registries and the
+// done/joined flags of every isolate. A joined isolate or a closed channel
+// is freed and leaves NULL behind in its registry, so stale handles still
+// fail to look up.
+static pthread_mutex_t poolLock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workAvailable   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t isolateFinished = PTHREAD_COND_INITIALIZER;
+
+static pthread_t* workers = NULL;
+static int workerCount    = 0;
+static int workerCapacity = 0;
+// Workers not running an isolate, counting those that have not started yet.
+static int idleWorkers = 0;
+// Workers whose isolate waits in join() or receive(): no longer running, but not idle either.
+static int blockedWorkers = 0;
+static bool shuttingDown  = false;
+static _Thread_local bool onWorker = false;
+
+static Isolate* queueHead = NULL;
+static Isolate* queueTail = NULL;
+
+static Isolate** isolates  = NULL;
+static int isolateCount    = 0;
+static int isolateCapacity = 0;
+static Channel** channels  = NULL;
+static int channelCount    = 0;
+static int channelCapacity = 0;
+
+static void initPacket(Packet* packet) {
+    packet->count    = 0;
+    packet->capacity = 0;
+    packet->read     = 0;
+    packet->bytes    = NULL;
+}
+
+static void freePacket(Packet* packet) {
+    free(packet->bytes);
+    initPacket(packet);
+}
+
+static void packBytes(Packet* packet, const void* bytes, int size) {
+    if (packet->capacity < packet->count + size) {
+        while (packet->capacity < packet->count + size) {
+            packet->capacity = GROW_CAPACITY(packet->capacity);
+        }
+        packet->bytes = (uint8_t*) realloc(packet->bytes, packet->capacity);
+        if (packet->bytes == NULL) exit(1);
+    }
+    memcpy(packet->bytes + packet->count, bytes, size);
+    packet->count += size;
+}
+
+static void packTag(Packet* packet, PackTag tag) {
+    uint8_t byte = (uint8_t) tag;
+    packBytes(packet, &byte, 1);
+}
+
+static bool packValue(Packet* packet, Value value);
+
+static bool packFunction(Packet* packet, ObjFunction* function) {
+    packBytes(packet, &function->arity, sizeof(int));
+    packBytes(packet, &function->upvalueCount, sizeof(int));
+    packBytes(packet, &function->superSites, sizeof(int));
+    if (function->name == NULL) {
+        packTag(packet, PACK_NIL);
+    } else {
+        packValue(packet, OBJ_VAL(function->name));
+    }
+
+    Chunk* chunk = &function->chunk;
+    packBytes(packet, &chunk->count, sizeof(int));
+    packBytes(packet, chunk->bcode, chunk->count);
+    packBytes(packet, chunk->lines, (int) sizeof(int) * chunk->count);
+    packBytes(packet, &chunk->constants.count, sizeof(int));
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!packValue(packet, chunk->constants.values[i])) return false;
+    }
+    return true;
+}
+
+/*
+ * Serialize a value into the packet. Returns false when the value cannot leave
+ * its heap (instances, classes, closures that capture upvalues...).
+ */
+static bool packValue(Packet* packet, Value value) {
+    if (IS_NIL(value)) {
+        packTag(packet, PACK_NIL);
+    } else if (IS_BOOL(value)) {
+        packTag(packet, AS_BOOL(value) ? PACK_TRUE : PACK_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        packTag(packet, PACK_NUMBER);
+        packBytes(packet, &number, sizeof(double));
+    } else if (IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        packTag(packet, string->selector >= 0 ? PACK_SELECTOR : PACK_STRING);
+        packBytes(packet, &string->length, sizeof(int));
+        packBytes(packet, string->chars, string->length);
+    } else if (IS_ROPE(value)) {
+        // Walking the rope allocates nothing, so the value needs no rooting.
+        ObjRope* rope = AS_ROPE(value);
+        char* chars   = malloc(rope->length);
+        if (chars == NULL) exit(1);
+        ropeChars(rope, chars);
+        packTag(packet, PACK_STRING);
+        packBytes(packet, &rope->length, sizeof(int));
+        packBytes(packet, chars, rope->length);
+        free(chars);
+    } else if (IS_FUNCTION(value)) {
+        packTag(packet, PACK_FUNCTION);
+        return packFunction(packet, AS_FUNCTION(value));
+    } else if (IS_CLOSURE(value) && AS_CLOSURE(value)->upvalueCount == 0) {
+        packTag(packet, PACK_CLOSURE);
+        return packFunction(packet, AS_CLOSURE(value)->function);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void unpackBytes(Packet* packet, void* bytes, int size) {
+    memcpy(bytes, packet->bytes + packet->read, size);
+    packet->read += size;
+}
+
+static Value unpackValue(Packet* packet);
+
+static ObjFunction* unpackFunction(Packet* packet) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    unpackBytes(packet, &function->arity, sizeof(int));
+    unpackBytes(packet, &function->upvalueCount, sizeof(int));
+    unpackBytes(packet, &function->superSites, sizeof(int));
+    Value name     = unpackValue(packet);
+    function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+
+    int count;
+    unpackBytes(packet, &count, sizeof(int));
+    const uint8_t* bcode = packet->bytes + packet->read;
+    const uint8_t* lines = bcode + count;
+    packet->read += count + (int) sizeof(int) * count;
+    for (int i = 0; i < count; i++) {
+        int line;
+        memcpy(&line, lines + sizeof(int) * i, sizeof(int));
+        writeChunk(&function->chunk, bcode[i], line);
+    }
+
+    int constantCount;
+    unpackBytes(packet, &constantCount, sizeof(int));
+    for (int i = 0; i < constantCount; i++) {
+        addConstant(&function->chunk, unpackValue(packet));
+    }
+    pop();
+    return function;
+}
+
+// Rebuild a packed value in the current thread's heap.
+static Value unpackValue(Packet* packet) {
+    uint8_t tag;
+    unpackBytes(packet, &tag, 1);
+    switch (tag) {
+        case PACK_FALSE:
+            return BOOL_VAL(false);
+        case PACK_TRUE:
+            return BOOL_VAL(true);
+        case PACK_NUMBER: {
+            double number;
+            unpackBytes(packet, &number, sizeof(double));
+            return NUMBER_VAL(number);
+        }
+        case PACK_STRING:
+        case PACK_SELECTOR: {
+            int length;
+            unpackBytes(packet, &length, sizeof(int));
+            ObjString* string = copyString((const char*) packet->bytes + packet->read, length);
+            packet->read += length;
+            if (tag == PACK_SELECTOR) {
+                push(OBJ_VAL(string));
+                internSelector(string);
+                pop();
+            }
+            return OBJ_VAL(string);
+        }
+        case PACK_FUNCTION:
+            return OBJ_VAL(unpackFunction(packet));
+        case PACK_CLOSURE: {
+            ObjFunction* function = unpackFunction(packet);
+            push(OBJ_VAL(function));
+            ObjClosure* closure = newClosure(function);
+            pop();
+            return OBJ_VAL(closure);
+        }
+        default:
+            return NIL_VAL;
+    }
+}
+
+static void freeIsolate(Isolate* isolate) {
+    free(isolate->source);
+    freePacket(&isolate->callee);
+    freePacket(&isolate->args);
+    freePacket(&isolate->result);
+    free(isolate);
+}
+
+static void runIsolate(Isolate* isolate) {
+    initVM();
+
+    Value result = NIL_VAL;
+    if (isolate->source != NULL) {
+        interpret(isolate->source);
+        free(isolate->source);
+        isolate->source = NULL;
+    } else {
+        push(unpackValue(&isolate->callee));
+        for (int i = 0; i < isolate->argCount; i++) {
+            push(unpackValue(&isolate->args));
+        }
+        freePacket(&isolate->callee);
+        freePacket(&isolate->args);
+        if (interpretCall(isolate->argCount) == INTERPRET_OK) result = pop();
+    }
+
+    // A result that cannot be copied out of the isolate is joined as nil.
+    if (!packValue(&isolate->result, result)) {
+        freePacket(&isolate->result);
+        packTag(&isolate->result, PACK_NIL);
+    }
+
+#ifdef CLOX_BENCH
+    isolate->instructions = vm.instructionCount;
+    isolate->peakHeap     = gcStats.peakHeap + vm.isolatePeakHeap;
+#endif
+    freeVM();
+}
+
+static void* workerMain(void* _) {
+    blockCpuProfileSignal();
+    onWorker = true;
+    pthread_mutex_lock(&poolLock);
+    for (;;) {
+        while (queueHead == NULL && !shuttingDown) {
+            pthread_cond_wait(&workAvailable, &poolLock);
+        }
+        if (queueHead == NULL) break;
+
+        Isolate* isolate = queueHead;
+        queueHead        = isolate->next;
+        if (queueHead == NULL) queueTail = NULL;
+        idleWorkers--;
+        pthread_mutex_unlock(&poolLock);
+
+        runIsolate(isolate);
+
+        pthread_mutex_lock(&poolLock);
+        isolate->done = true;
+        idleWorkers++;
+        pthread_cond_broadcast(&isolateFinished);
+    }
+    idleWorkers--;
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+}
+
+// Called with poolLock held.
+static void addWorker() {
+    if (workerCapacity < workerCount + 1) {
+        workerCapacity = GROW_CAPACITY(workerCapacity);
+        workers        = (pthread_t*) realloc(workers, sizeof(pthread_t) * workerCapacity);
+        if (workers == NULL) exit(1);
+    }
+    if (pthread_create(&workers[workerCount], NULL, workerMain, NULL) != 0) exit(1);
+    workerCount++;
+    idleWorkers++;
+}
+
+// Start the worker pool the first time something is spawned. Called with poolLock held.
+static void startWorkers() {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int count       = processors < ISOLATE_THREADS_MIN ? ISOLATE_THREADS_MIN : (int) processors;
+    for (int i = 0; i < count; i++) {
+        addWorker();
+    }
+}
+
+/*
+ * A worker about to wait on another isolate gives up its thread meanwhile and
+ * stops counting as running until workerResumes(). If isolates are queued and
+ * no other worker is free to run them, start one more, or isolates that spawn
+ * and join their own would deadlock once they fill the pool. spawnNative()
+ * does the same for isolates queued after every worker has blocked. Called
+ * with poolLock held.
+ */
+static void workerBlocks() {
+    if (!onWorker) return;
+    blockedWorkers++;
+    if (queueHead != NULL && idleWorkers == 0) addWorker();
+}
+
+// Called with poolLock held.
+static void workerResumes() {
+    if (onWorker) blockedWorkers--;
+}
+
+static char* readSource(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*) malloc(fileSize + 1);
+    if (buffer == NULL) exit(1);
+    size_t bytesRead  = fread(buffer, sizeof(char), fileSize, file);
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+// Look up a registry handle passed in from Lox. Returns -1 when it does not name an entry.
+static int handleIndex(Value handle, int count) {
+    if (!IS_NUMBER(handle)) return -1;
+    double number = AS_NUMBER(handle);
+    if (number < 0 || number >= count || number != (int) number) return -1;
+    return (int) number;
+}
+
+Value spawnNative(int argCount, Value* args) {
+    if (argCount == 0) {
+        runtimeError("spawn() expects a script path or a function.");
+        return NIL_VAL;
+    }
+    // A path is read as a C string, which a view is not.
+    if (IS_STRING(args[0])) args[0] = OBJ_VAL(ownString(AS_STRING(args[0])));
+
+    Isolate* isolate = (Isolate*) calloc(1, sizeof(Isolate));
+    if (isolate == NULL) exit(1);
+    initPacket(&isolate->callee);
+    initPacket(&isolate->args);
+    initPacket(&isolate->result);
+
+    if (IS_STRING(args[0])) {
+        if (argCount != 1) {
+            freeIsolate(isolate);
+            runtimeError("A spawned script takes no arguments.");
+            return NIL_VAL;
+        }
+        isolate->source = readSource(AS_CSTRING(args[0]));
+        if (isolate->source == NULL) {
+            freeIsolate(isolate);
+            runtimeError("Could not read script \"%s\".", AS_CSTRING(args[0]));
+            return NIL_VAL;
+        }
+    } else if (!IS_CLOSURE(args[0]) || !packValue(&isolate->callee, args[0])) {
+        freeIsolate(isolate);
+        runtimeError("Can only spawn scripts and functions that capture no upvalues.");
+        return NIL_VAL;
+    }
+
+    for (int i = 1; i < argCount; i++) {
+        if (!packValue(&isolate->args, args[i])) {
+            freeIsolate(isolate);
+            runtimeError("Argument %d of spawn() cannot be copied to another isolate.", i);
+            return NIL_VAL;
+        }
+    }
+    isolate->argCount = argCount - 1;
+
+    pthread_mutex_lock(&poolLock);
+    if (workers == NULL) startWorkers();
+
+    if (isolateCapacity < isolateCount + 1) {
+        isolateCapacity = GROW_CAPACITY(isolateCapacity);
+        isolates        = (Isolate**) realloc(isolates, sizeof(Isolate*) * isolateCapacity);
+        if (isolates == NULL) exit(1);
+    }
+    int id                   = isolateCount;
+    isolates[isolateCount++] = isolate;
+
+    if (queueTail == NULL) {
+        queueHead = isolate;
+    } else {
+        queueTail->next = isolate;
+    }
+    queueTail = isolate;
+    // Blocked workers may be waiting on this very isolate.
+    if (idleWorkers == 0 && blockedWorkers > 0) addWorker();
+    pthread_cond_signal(&workAvailable);
+    pthread_mutex_unlock(&poolLock);
+
+    return NUMBER_VAL(id);
+}
+
+Value joinNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("join() expects exactly 1 argument.");
+        return NIL_VAL;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    int index = handleIndex(args[0], isolateCount);
+    if (index == -1 || isolates[index] == NULL || isolates[index]->joined) {
+        pthread_mutex_unlock(&poolLock);
+        runtimeError("join() expects an isolate that has not been joined yet.");
+        return NIL_VAL;
+    }
+
+    Isolate* isolate = isolates[index];
+    isolate->joined  = true;
+    if (!isolate->done) {
+        workerBlocks();
+        while (!isolate->done) {
+            pthread_cond_wait(&isolateFinished, &poolLock);
+        }
+        workerResumes();
+    }
+    isolates[index] = NULL;
+    pthread_mutex_unlock(&poolLock);
+
+    // Nobody else touches a joined isolate.
+#ifdef CLOX_BENCH
+    vm.instructionCount += isolate->instructions;
+    vm.isolatePeakHeap += isolate->peakHeap;
+#endif
+    Value result = unpackValue(&isolate->result);
+    freeIsolate(isolate);
+    return result;
+}
+
+Value channelNative(int argCount, Value* args) {
+    Channel* channel = (Channel*) malloc(sizeof(Channel));
+    if (channel == NULL) exit(1);
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->ready, NULL);
+    channel->head   = NULL;
+    channel->tail   = NULL;
+    channel->closed = false;
+    channel->users  = 0;
+
+    pthread_mutex_lock(&poolLock);
+    if (channelCapacity < channelCount + 1) {
+        channelCapacity = GROW_CAPACITY(channelCapacity);
+        channels        = (Channel**) realloc(channels, sizeof(Channel*) * channelCapacity);
+        if (channels == NULL) exit(1);
+    }
+    int id                   = channelCount;
+    channels[channelCount++] = channel;
+    pthread_mutex_unlock(&poolLock);
+
+    return NUMBER_VAL(id);
+}
+
+static void freeChannel(Channel* channel) {
+    Message* message = channel->head;
+    while (message != NULL) {
+        Message* next = message->next;
+        freePacket(&message->packet);
+        free(message);
+        message = next;
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->ready);
+    free(channel);
+}
+
+// Look up an open channel, which stays allocated until releaseChannel().
+static Channel* findChannel(Value handle) {
+    pthread_mutex_lock(&poolLock);
+    int index        = handleIndex(handle, channelCount);
+    Channel* channel = index == -1 ? NULL : channels[index];
+    if (channel != NULL) channel->users++;
+    pthread_mutex_unlock(&poolLock);
+    return channel;
+}
+
+static void releaseChannel(Channel* channel) {
+    pthread_mutex_lock(&poolLock);
+    // closeChannelNative() has already dropped it from the registry.
+    if (--channel->users == 0 && channel->closed) freeChannel(channel);
+    pthread_mutex_unlock(&poolLock);
+}
+
+Value sendNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("send() expects a channel and a value.");
+        return NIL_VAL;
+    }
+    Channel* channel = findChannel(args[0]);
+    if (channel == NULL) {
+        runtimeError("First argument of send() must be an open channel.");
+        return NIL_VAL;
+    }
+
+    Message* message = (Message*) malloc(sizeof(Message));
+    if (message == NULL) exit(1);
+    initPacket(&message->packet);
+    message->next = NULL;
+    if (!packValue(&message->packet, args[1])) {
+        freePacket(&message->packet);
+        free(message);
+        releaseChannel(channel);
+        runtimeError("Only nil, booleans, numbers, strings and functions without upvalues can be sent.");
+        return NIL_VAL;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+    if (channel->tail == NULL) {
+        channel->head = message;
+    } else {
+        channel->tail->next = message;
+    }
+    channel->tail = message;
+    pthread_cond_signal(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+
+    releaseChannel(channel);
+    return NIL_VAL;
+}
+
+Value receiveNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("receive() expects exactly 1 argument.");
+        return NIL_VAL;
+    }
+    Channel* channel = findChannel(args[0]);
+    if (channel == NULL) {
+        runtimeError("First argument of receive() must be an open channel.");
+        return NIL_VAL;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+    bool blocked = channel->head == NULL && onWorker;
+    if (blocked) {
+        // The sender may still be queued. poolLock is never taken inside a channel's lock.
+        pthread_mutex_unlock(&channel->lock);
+        pthread_mutex_lock(&poolLock);
+        workerBlocks();
+        pthread_mutex_unlock(&poolLock);
+        pthread_mutex_lock(&channel->lock);
+    }
+    while (channel->head == NULL && !channel->closed) {
+        pthread_cond_wait(&channel->ready, &channel->lock);
+    }
+    Message* message = channel->head;
+    if (message != NULL) {
+        channel->head = message->next;
+        if (channel->head == NULL) channel->tail = NULL;
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    if (blocked) {
+        pthread_mutex_lock(&poolLock);
+        workerResumes();
+        pthread_mutex_unlock(&poolLock);
+    }
+    releaseChannel(channel);
+
+    // Closed while waiting.
+    if (message == NULL) return NIL_VAL;
+    Value value = unpackValue(&message->packet);
+    freePacket(&message->packet);
+    free(message);
+    return value;
+}
+
+Value closeChannelNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("closeChannel() expects exactly 1 argument.");
+        return NIL_VAL;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    int index = handleIndex(args[0], channelCount);
+    if (index == -1 || channels[index] == NULL) {
+        pthread_mutex_unlock(&poolLock);
+        runtimeError("closeChannel() expects a channel that is still open.");
+        return NIL_VAL;
+    }
+
+    Channel* channel = channels[index];
+    channels[index]  = NULL;
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+    // Otherwise the last native still using it frees it.
+    if (channel->users == 0) freeChannel(channel);
+    pthread_mutex_unlock(&poolLock);
+
+    return NIL_VAL;
+}
+
+void freeIsolates() {
+    pthread_mutex_lock(&poolLock);
+    shuttingDown = true;
+    pthread_cond_broadcast(&workAvailable);
+    pthread_mutex_unlock(&poolLock);
+
+    // Workers still running isolates may add more while we wait.
+    pthread_mutex_lock(&poolLock);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_t worker = workers[i];
+        pthread_mutex_unlock(&poolLock);
+        pthread_join(worker, NULL);
+        pthread_mutex_lock(&poolLock);
+    }
+    free(workers);
+    workers        = NULL;
+    workerCount    = 0;
+    workerCapacity = 0;
+    idleWorkers    = 0;
+    blockedWorkers = 0;
+    pthread_mutex_unlock(&poolLock);
+
+    for (int i = 0; i < isolateCount; i++) {
+        if (isolates[i] != NULL) freeIsolate(isolates[i]);
+    }
+    free(isolates);
+    isolates        = NULL;
+    isolateCount    = 0;
+    isolateCapacity = 0;
+
+    for (int i = 0; i < channelCount; i++) {
+        if (channels[i] != NULL) freeChannel(channels[i]);
+    }
+    free(channels);
+    channels        = NULL;
+    channelCount    = 0;
+    channelCapacity = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef CLOX_ISOLATE_H
+#define CLOX_ISOLATE_H
+
+#include "value.h"
+
+/*
+ * Isolates run a script or a function in a VM of their own, and therefore in
+ * a heap of their own, on a worker thread from a fixed pool.
+ *
+ * Isolates share nothing. They talk through channels, and every value that
+ * crosses from one heap to another (spawn arguments, messages and results) is
+ * copied: nil, booleans, numbers, strings and functions without upvalues.
+ * A spawned function runs against a fresh set of globals. Isolates may spawn
+ * and wait on isolates of their own: a worker that blocks in join() or
+ * receive() while others are queued and no worker is free adds a thread to
+ * the pool, which grows with the depth of such waits.
+ *
+ * An isolate is freed once it is joined and a channel once it is closed;
+ * their ids are not reused, and using them afterwards is an error. Values
+ * still in a closed channel are dropped, and receive() returns nil to
+ * isolates that were waiting on it.
+ *
+ * spawn(path | fn, args...)  start an isolate, returns its id
+ * join(id)                   wait for an isolate, returns its result
+ * channel()                  create a channel, returns its id
+ * send(channel, value)       copy a value into a channel
+ * receive(channel)           wait for the next value in a channel
+ * closeChannel(channel)      free a channel
+ */
+Value spawnNative(int argCount, Value* args);
+Value joinNative(int argCount, Value* args);
+Value channelNative(int argCount, Value* args);
+Value sendNative(int argCount, Value* args);
+Value receiveNative(int argCount, Value* args);
+Value closeChannelNative(int argCount, Value* args);
+
+// Wait for every spawned isolate to finish and stop the worker pool.
+void freeIsolates();
+
+#endif// CLOX_ISOLATE_H
@@ -1,7 +1,15 @@
 #include "chunk.h"
 #include "common.h"
+#include "compact.h"
+#include "cpuprof.h"
 #include "debug.h"
+#include "gcstats.h"
+#include "heapprof.h"
+#include "isolate.h"
+#include "marker.h"
 #include "memory.h"
+#include "object.h"
+#include "opcount.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,27 +57,190 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static InterpretResult runFile(const char* path) {
     char* source           = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
+    return result;
+}
 
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+static void usage() {
+    fprintf(stderr, "Usage: clox [--gc-threads n] [--gc-concurrent] [--gc-compact]\n"
+                    "            [--heap-initial size] [--heap-growth factor]\n"
+                    "            [--heap-soft-limit size] [--heap-hard-limit size]\n"
+                    "            [--gc-target-share fraction] [--gc-max-pause ms] [--gc-log-pacing]\n"
+                    "            [--gc-stats file] [--heap-profile file] [--heap-sample size]\n"
+                    "            [--heap-profile-gc] [--cpu-profile file] [--cpu-profile-hz n]\n"
+                    "            [--hash-seed n|random] [path]\n"
+                    "Sizes are in bytes, or in KB, MB or GB with a k, m or g suffix.\n"
+                    "--gc-stats writes collector statistics as JSON at exit, --heap-profile\n"
+                    "allocations by site at exit (and after every collection with\n"
+                    "--heap-profile-gc), and --cpu-profile sampled Lox stacks in the folded\n"
+                    "format flame graph tools read. A file of - is stderr. --hash-seed keys\n"
+                    "string hashes so crafted input cannot make them collide.\n"
+#ifdef DEBUG_COUNT_OPCODES
+                    "This build counts opcodes and writes them as CSV files into the\n"
+                    "directory given by --op-counts dir, or the current one.\n"
+#endif
+    );
+    exit(64);
+}
+
+static size_t parseSize(const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) usage();
+    switch (*end) {
+        case 'g': case 'G': size *= 1024;// fallthrough
+        case 'm': case 'M': size *= 1024;// fallthrough
+        case 'k': case 'K': size *= 1024; end++; break;
+        default: break;
+    }
+    if (*end != '\0') usage();
+    return (size_t) size;
+}
+
+static uint64_t parseSeed(const char* text) {
+    uint64_t seed = 0;
+    if (strcmp(text, "random") == 0) {
+        FILE* random = fopen("/dev/urandom", "rb");
+        if (random == NULL || fread(&seed, sizeof(seed), 1, random) != 1) {
+            fprintf(stderr, "Could not read /dev/urandom.\n");
+            exit(71);
+        }
+        fclose(random);
+    } else {
+        char* end;
+        seed = strtoull(text, &end, 0);
+        if (end == text || *end != '\0') usage();
+    }
+    // A hashSeed of 0 is no seed at all.
+    return seed != 0 ? seed : 1;
 }
 
 int main(int argc, const char* argv[]) {
+    const char* path      = NULL;
+    const char* statsPath = NULL;
+    const char* profile   = NULL;
+    size_t sampleRate     = 512 * 1024;
+    bool profileEveryGC   = false;
+    const char* cpuPath   = NULL;
+    int cpuHertz          = 1000;
+#ifdef DEBUG_COUNT_OPCODES
+    const char* countsDir = ".";
+#endif
+    int gcThreads         = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc-threads") == 0) {
+            if (++i == argc) usage();
+            gcThreads = atoi(argv[i]);
+            if (gcThreads < 1) usage();
+        } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+            concurrentMarking = true;
+        } else if (strcmp(argv[i], "--gc-compact") == 0) {
+            compactingGC = true;
+        } else if (strcmp(argv[i], "--heap-initial") == 0) {
+            if (++i == argc) usage();
+            heapConfig.initialHeap = parseSize(argv[i]);
+        } else if (strcmp(argv[i], "--heap-growth") == 0) {
+            if (++i == argc) usage();
+            heapConfig.growthFactor = atof(argv[i]);
+            if (heapConfig.growthFactor <= 1) usage();
+        } else if (strcmp(argv[i], "--heap-soft-limit") == 0) {
+            if (++i == argc) usage();
+            heapConfig.softLimit = parseSize(argv[i]);
+        } else if (strcmp(argv[i], "--heap-hard-limit") == 0) {
+            if (++i == argc) usage();
+            heapConfig.hardLimit = parseSize(argv[i]);
+        } else if (strcmp(argv[i], "--gc-target-share") == 0) {
+            if (++i == argc) usage();
+            heapConfig.targetGCShare = atof(argv[i]);
+            if (heapConfig.targetGCShare <= 0 || heapConfig.targetGCShare >= 1) usage();
+        } else if (strcmp(argv[i], "--gc-max-pause") == 0) {
+            if (++i == argc) usage();
+            heapConfig.maxPause = atof(argv[i]) / 1000;
+            if (heapConfig.maxPause <= 0) usage();
+        } else if (strcmp(argv[i], "--gc-log-pacing") == 0) {
+            heapConfig.logPacing = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            if (++i == argc) usage();
+            statsPath = argv[i];
+        } else if (strcmp(argv[i], "--heap-profile") == 0) {
+            if (++i == argc) usage();
+            profile = argv[i];
+        } else if (strcmp(argv[i], "--heap-sample") == 0) {
+            if (++i == argc) usage();
+            sampleRate = parseSize(argv[i]);
+            if (sampleRate == 0) usage();
+        } else if (strcmp(argv[i], "--heap-profile-gc") == 0) {
+            profileEveryGC = true;
+        } else if (strcmp(argv[i], "--cpu-profile") == 0) {
+            if (++i == argc) usage();
+            cpuPath = argv[i];
+        } else if (strcmp(argv[i], "--cpu-profile-hz") == 0) {
+            if (++i == argc) usage();
+            cpuHertz = atoi(argv[i]);
+            if (cpuHertz < 1) usage();
+        } else if (strcmp(argv[i], "--hash-seed") == 0) {
+            if (++i == argc) usage();
+            hashSeed = parseSeed(argv[i]);
+#ifdef DEBUG_COUNT_OPCODES
+        } else if (strcmp(argv[i], "--op-counts") == 0) {
+            if (++i == argc) usage();
+            countsDir = argv[i];
+#endif
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    startMarkers(gcThreads);
     initVM();
-    if (argc == 1) {
+    FILE* profileFile = NULL;
+    if (profile != NULL) {
+        profileFile = strcmp(profile, "-") == 0 ? stderr : fopen(profile, "w");
+        if (profileFile == NULL) {
+            fprintf(stderr, "Could not open \"%s\".\n", profile);
+            exit(74);
+        }
+        startHeapProfile(sampleRate, profileFile, profileEveryGC);
+    }
+    if (cpuPath != NULL && !startCpuProfile(cpuHertz)) {
+        fprintf(stderr, "Could not start the CPU profiler.\n");
+        exit(71);
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox[path]\n");
+        result = runFile(path);
+    }
+
+    if (statsPath != NULL && !writeGCStats(statsPath)) {
+        fprintf(stderr, "Could not write \"%s\".\n", statsPath);
+    }
+    if (profileFile != NULL) {
+        writeHeapProfile("at exit");
+        stopHeapProfile();
+        if (profileFile != stderr) fclose(profileFile);
     }
+    if (cpuPath != NULL) {
+        if (!writeCpuProfile(cpuPath)) fprintf(stderr, "Could not write \"%s\".\n", cpuPath);
+        stopCpuProfile();
+    }
+#ifdef DEBUG_COUNT_OPCODES
+    if (!writeOpCounts(countsDir)) fprintf(stderr, "Could not write opcode counts to \"%s\".\n", countsDir);
+#endif
+    if (result == INTERPRET_COMPILE_ERROR)
+        exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR)
+        exit(70);
 
     freeVM();
+    freeIsolates();
+    stopMarkers();
     return 0;
 }
@@ -0,0 +1,415 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cpuprof.h"
+#include "marker.h"
+#include "memory.h"
+
+#define MARKERS_MAX 64
+#define DEQUE_MIN 1024
+
+/*
+ * The deques are Chase-Lev deques: the owner pushes and takes at the bottom
+ * without locking, thieves take from the top with a compare-and-swap, and
+ * the two only race for the last object. A deque that fills up moves to an
+ * array twice the size; the old array stays around until marking is over,
+ * since a thief may still be reading from it.
+ */
+typedef struct DequeArray {
+    long capacity;
+    struct DequeArray* retired;
+    _Atomic(Obj*) objects[];
+} DequeArray;
+
+typedef struct Marker {
+    _Alignas(64) atomic_long top;
+    atomic_long bottom;
+    _Atomic(DequeArray*) array;
+} Marker;
+
+/*
+ * One background marking cycle of one VM. It lives in the mutator's thread
+ * local storage; the background thread gets a pointer to it. The background
+ * thread owns marker and steals from shaded, the deque the mutator's barriers
+ * push onto.
+ */
+typedef struct ConcurrentMark {
+    Marker marker;
+    Marker shaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    unsigned long epoch;
+    atomic_bool idle;
+    atomic_bool stop;
+} ConcurrentMark;
+
+_Thread_local Marker* currentMarker                 = NULL;
+_Thread_local ConcurrentMark* concurrentMark        = NULL;
+static _Thread_local ConcurrentMark concurrentCycle = {.lock = PTHREAD_MUTEX_INITIALIZER};
+bool concurrentMarking                              = false;
+
+static Marker markers[MARKERS_MAX];
+static int markerCount = 1;
+static atomic_int idleMarkers;
+static pthread_t threads[MARKERS_MAX];
+
+// poolLock is held by the collecting thread from beginParallelMark() to finishParallelMark().
+static pthread_mutex_t poolLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone   = PTHREAD_COND_INITIALIZER;
+static unsigned long generation  = 0;
+static int running               = 0;
+static bool stopping             = false;
+
+static DequeArray* newDequeArray(long capacity) {
+    DequeArray* array = malloc(sizeof(DequeArray) + sizeof(_Atomic(Obj*)) * capacity);
+    if (array == NULL) exit(1);
+    array->capacity = capacity;
+    array->retired  = NULL;
+    return array;
+}
+
+static DequeArray* growDeque(Marker* marker, DequeArray* array, long top, long bottom) {
+    DequeArray* grown = newDequeArray(array->capacity * 2);
+    for (long i = top; i < bottom; i++) {
+        Obj* object = atomic_load_explicit(&array->objects[i & (array->capacity - 1)], memory_order_relaxed);
+        atomic_store_explicit(&grown->objects[i & (grown->capacity - 1)], object, memory_order_relaxed);
+    }
+    grown->retired = array;
+    atomic_store_explicit(&marker->array, grown, memory_order_release);
+    return grown;
+}
+
+static void pushMark(Marker* marker, Obj* object) {
+    long bottom       = atomic_load_explicit(&marker->bottom, memory_order_relaxed);
+    long top          = atomic_load_explicit(&marker->top, memory_order_acquire);
+    DequeArray* array = atomic_load_explicit(&marker->array, memory_order_relaxed);
+    if (bottom - top >= array->capacity) array = growDeque(marker, array, top, bottom);
+
+    atomic_store_explicit(&array->objects[bottom & (array->capacity - 1)], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Obj* takeMark(Marker* marker) {
+    long bottom       = atomic_load_explicit(&marker->bottom, memory_order_relaxed) - 1;
+    DequeArray* array = atomic_load_explicit(&marker->array, memory_order_relaxed);
+    atomic_store_explicit(&marker->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&marker->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Obj* object = atomic_load_explicit(&array->objects[bottom & (array->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last object: a thief may be taking it right now.
+        if (!atomic_compare_exchange_strong_explicit(&marker->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            object = NULL;
+        }
+        atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static Obj* stealMark(Marker* victim, bool* contended) {
+    long top = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    DequeArray* array = atomic_load_explicit(&victim->array, memory_order_acquire);
+    Obj* object       = atomic_load_explicit(&array->objects[top & (array->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        *contended = true;
+        return NULL;
+    }
+    return object;
+}
+
+static Obj* steal(int self) {
+    bool contended;
+    do {
+        contended = false;
+        for (int i = 1; i < markerCount; i++) {
+            Obj* object = stealMark(&markers[(self + i) % markerCount], &contended);
+            if (object != NULL) return object;
+        }
+    } while (contended);
+    return NULL;
+}
+
+static bool hasWork() {
+    for (int i = 0; i < markerCount; i++) {
+        if (atomic_load(&markers[i].bottom) > atomic_load(&markers[i].top)) return true;
+    }
+    return false;
+}
+
+/*
+ * Blacken objects until there are none left anywhere. Only a busy marker can
+ * make new gray objects, so once every marker is idle marking is done.
+ */
+static void mark(int self) {
+    Marker* marker = &markers[self];
+    currentMarker  = marker;
+    for (;;) {
+        Obj* object = takeMark(marker);
+        if (object == NULL) object = steal(self);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        atomic_fetch_add(&idleMarkers, 1);
+        for (;;) {
+            if (atomic_load(&idleMarkers) == markerCount) {
+                currentMarker = NULL;
+                return;
+            }
+            if (hasWork()) {
+                atomic_fetch_sub(&idleMarkers, 1);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* markerThread(void* arg) {
+    int self           = (int) (intptr_t) arg;
+    unsigned long seen = 0;
+    blockCpuProfileSignal();
+
+    pthread_mutex_lock(&stateLock);
+    for (;;) {
+        while (generation == seen && !stopping) pthread_cond_wait(&markStart, &stateLock);
+        if (stopping) break;
+        seen = generation;
+        pthread_mutex_unlock(&stateLock);
+
+        mark(self);
+
+        pthread_mutex_lock(&stateLock);
+        if (--running == 0) pthread_cond_signal(&markDone);
+    }
+    pthread_mutex_unlock(&stateLock);
+    return NULL;
+}
+
+void startMarkers(int threadCount) {
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > MARKERS_MAX) threadCount = MARKERS_MAX;
+
+    for (int i = 0; i < threadCount; i++) {
+        atomic_init(&markers[i].top, 0);
+        atomic_init(&markers[i].bottom, 0);
+        atomic_init(&markers[i].array, newDequeArray(DEQUE_MIN));
+    }
+    markerCount = 1;
+    for (int i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, markerThread, (void*) (intptr_t) i) != 0) break;
+        markerCount++;
+    }
+}
+
+void stopMarkers() {
+    pthread_mutex_lock(&stateLock);
+    stopping = true;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&stateLock);
+    for (int i = 1; i < markerCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < markerCount; i++) {
+        DequeArray* array = atomic_load(&markers[i].array);
+        while (array != NULL) {
+            DequeArray* retired = array->retired;
+            free(array);
+            array = retired;
+        }
+    }
+    markerCount = 1;
+}
+
+bool beginParallelMark() {
+    if (markerCount < 2 || pthread_mutex_trylock(&poolLock) != 0) return false;
+
+    for (int i = 0; i < markerCount; i++) {
+        atomic_store(&markers[i].top, 0);
+        atomic_store(&markers[i].bottom, 0);
+    }
+    atomic_store(&idleMarkers, 0);
+    currentMarker = &markers[0];
+    return true;
+}
+
+void finishParallelMark() {
+    pthread_mutex_lock(&stateLock);
+    generation++;
+    running = markerCount - 1;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&stateLock);
+
+    mark(0);
+
+    pthread_mutex_lock(&stateLock);
+    while (running > 0) pthread_cond_wait(&markDone, &stateLock);
+    pthread_mutex_unlock(&stateLock);
+
+    for (int i = 0; i < markerCount; i++) {
+        DequeArray* array = atomic_load(&markers[i].array);
+        while (array->retired != NULL) {
+            DequeArray* retired = array->retired;
+            array->retired      = retired->retired;
+            free(retired);
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+void markShared(Obj* object) {
+    // Checking first keeps the common case, an object that is already marked, free of writes.
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) return;
+    if (atomic_exchange_explicit(&object->isMarked, true, memory_order_relaxed)) return;
+    if (object->type == OBJ_STRING) {
+        if (((ObjString*) object)->parent != NULL) markShared((Obj*) ((ObjString*) object)->parent);
+        return;
+    }
+    if (object->type == OBJ_NATIVE) return;
+    pushMark(currentMarker, object);
+}
+
+static void initDeque(Marker* marker) {
+    atomic_init(&marker->top, 0);
+    atomic_init(&marker->bottom, 0);
+    atomic_init(&marker->array, newDequeArray(DEQUE_MIN));
+}
+
+static void freeDeque(Marker* marker) {
+    DequeArray* array = atomic_load(&marker->array);
+    while (array != NULL) {
+        DequeArray* retired = array->retired;
+        free(array);
+        array = retired;
+    }
+}
+
+static bool isDequeEmpty(Marker* marker) {
+    return atomic_load(&marker->bottom) <= atomic_load(&marker->top);
+}
+
+void beginConcurrentMark() {
+    ConcurrentMark* mark = &concurrentCycle;
+    initDeque(&mark->marker);
+    initDeque(&mark->shaded);
+    mark->epoch++;
+    atomic_store(&mark->idle, false);
+    atomic_store(&mark->stop, false);
+
+    concurrentMark = mark;
+    currentMarker  = &mark->shaded;
+}
+
+static void* concurrentMarkThread(void* arg) {
+    ConcurrentMark* mark = arg;
+    concurrentMark       = mark;
+    currentMarker        = &mark->marker;
+    blockCpuProfileSignal();
+
+    while (!atomic_load(&mark->stop)) {
+        bool contended = false;
+        Obj* object    = takeMark(&mark->marker);
+        if (object == NULL) object = stealMark(&mark->shaded, &contended);
+        if (object != NULL) {
+            atomic_store(&mark->idle, false);
+            blackenObject(object);
+            continue;
+        }
+        if (contended) continue;
+
+        // Nothing left until the mutator shades something.
+        atomic_store(&mark->idle, true);
+        struct timespec nap = {0, 50000};
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+void startConcurrentMark() {
+    if (pthread_create(&concurrentCycle.thread, NULL, concurrentMarkThread, &concurrentCycle) != 0) {
+        // No thread: stopConcurrentMark() will do all the marking in the final pause.
+        atomic_store(&concurrentCycle.stop, true);
+    }
+}
+
+bool concurrentMarkDone() {
+    ConcurrentMark* mark = concurrentMark;
+    return atomic_load(&mark->stop) ||
+           (atomic_load(&mark->idle) && isDequeEmpty(&mark->shaded) && isDequeEmpty(&mark->marker));
+}
+
+void stopConcurrentMark() {
+    ConcurrentMark* mark = concurrentMark;
+    if (!atomic_exchange(&mark->stop, true)) pthread_join(mark->thread, NULL);
+}
+
+void finishConcurrentMark() {
+    // The background thread is gone, so the mutator owns both deques now.
+    ConcurrentMark* mark = concurrentMark;
+    for (;;) {
+        Obj* object = takeMark(&mark->shaded);
+        if (object == NULL) object = takeMark(&mark->marker);
+        if (object == NULL) break;
+        blackenObject(object);
+    }
+
+    freeDeque(&mark->marker);
+    freeDeque(&mark->shaded);
+    concurrentMark = NULL;
+    currentMarker  = NULL;
+}
+
+void scanFiber(ObjFiber* fiber) {
+    markObject((Obj*) fiber);
+    blackenObject((Obj*) fiber);
+}
+
+/*
+ * Claim the scan of a fiber. During a concurrent cycle every fiber is scanned
+ * once, by whichever thread gets to it first, with the heap locked until
+ * endFiberScan(); outside of one there is nothing to claim.
+ */
+bool beginFiberScan(ObjFiber* fiber) {
+    ConcurrentMark* mark = concurrentMark;
+    if (mark == NULL) return true;
+
+    pthread_mutex_lock(&mark->lock);
+    if (fiber->scanEpoch == mark->epoch) {
+        pthread_mutex_unlock(&mark->lock);
+        return false;
+    }
+    fiber->scanEpoch = mark->epoch;
+    return true;
+}
+
+void endFiberScan() {
+    if (concurrentMark != NULL) pthread_mutex_unlock(&concurrentMark->lock);
+}
+
+void lockHeap() {
+    if (concurrentMark != NULL) pthread_mutex_lock(&concurrentMark->lock);
+}
+
+void unlockHeap() {
+    if (concurrentMark != NULL) pthread_mutex_unlock(&concurrentMark->lock);
+}
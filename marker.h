@@ -0,0 +1,78 @@
+#ifndef CLOX_MARKER_H
+#define CLOX_MARKER_H
+
+#include "object.h"
+
+/*
+ * Parallel marking. A fixed pool of marker threads helps the collecting
+ * thread trace the heap: every marker owns a work-stealing deque of gray
+ * objects, pops from its own end and steals from the other end of everyone
+ * else's when it runs dry. Marking is over once every marker is idle.
+ *
+ * The pool is shared by every VM in the process. A VM that collects while
+ * another one holds the pool marks on its own thread, as does every VM when
+ * the pool has a single thread.
+ */
+
+/*
+ * Concurrent marking (--gc-concurrent) traces the heap on a background thread
+ * while the program keeps running. A short pause marks the roots and scans
+ * the running fiber's stack, the background thread marks from there, and a
+ * final pause drains what is left before the sweep.
+ *
+ * This is a snapshot-at-the-beginning collector: everything reachable when
+ * marking starts gets marked, and objects allocated meanwhile are born
+ * marked. The mutator keeps that promise with barriers:
+ *
+ * - SHADE() marks a reference before it is overwritten or deleted from a
+ *   table or an upvalue, and any interned string a lookup hands back.
+ * - Stack slots have no barrier. Instead a fiber's stack is scanned before
+ *   the fiber first runs during a cycle (scanFiber() in switchFiber()), so
+ *   the background thread only ever scans fibers that are not running.
+ * - lockHeap() guards the arrays the background thread reads: table
+ *   entries, value arrays and fiber stacks. Whoever replaces such an array
+ *   allocates the new one first and swaps it in under the lock. Stores into
+ *   table slots and upvalues skip the lock: each is a single aligned Value
+ *   whose old contents were shaded first, so the background thread can see
+ *   either one.
+ */
+
+// The marker the current thread pushes gray objects onto, if it is marking in parallel.
+extern _Thread_local struct Marker* currentMarker;
+// Set on the mutator and the background thread while a concurrent cycle runs.
+extern _Thread_local struct ConcurrentMark* concurrentMark;
+extern bool concurrentMarking;
+
+#define SHADE(value)                                  \
+    do {                                              \
+        if (concurrentMark != NULL) markValue(value); \
+    } while (false)
+
+// Start the pool. threadCount includes the collecting thread.
+void startMarkers(int threadCount);
+void stopMarkers();
+
+// Claim the pool for a collection. Roots marked afterwards go to the caller's deque.
+bool beginParallelMark();
+// Trace everything reachable from the roots with the whole pool, then release it.
+void finishParallelMark();
+void markShared(Obj* object);
+
+// The first pause: roots marked afterwards go to the background marker.
+void beginConcurrentMark();
+// Start the background thread once the roots are marked.
+void startConcurrentMark();
+// True once the background thread has run out of work.
+bool concurrentMarkDone();
+// The final pause: stop the background thread. Roots marked afterwards are drained too.
+void stopConcurrentMark();
+void finishConcurrentMark();
+
+// Scan a fiber's stack unless it has already been scanned this cycle.
+void scanFiber(ObjFiber* fiber);
+bool beginFiberScan(ObjFiber* fiber);
+void endFiberScan();
+void lockHeap();
+void unlockHeap();
+
+#endif// CLOX_MARKER_H
@@ -1,7 +1,13 @@
 #include "memory.h"
 
+#include "compact.h"
 #include "compiler.h"
+#include "eventloop.h"
+#include "gcstats.h"
+#include "heapprof.h"
+#include "marker.h"
 #include "object.h"
+#include "pacer.h"
 #include "vm.h"
 #include <stdlib.h>
 
@@ -11,39 +17,94 @@
 #include <stdio.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+HeapConfig heapConfig = {
+        .initialHeap   = 1024 * 1024,
+        .growthFactor  = 2,
+        .softLimit     = 0,
+        .hardLimit     = 0,
+        .targetGCShare = 0,
+        .maxPause      = 0,
+        .logPacing     = false,
+};
+
+// Collect everything that is garbage right now, finishing or running a whole concurrent cycle.
+static void collectFully() {
+    collectGarbage();
+    if (concurrentMark != NULL) collectGarbage();
+}
 
+void reserveMemory(size_t size) {
+    if (heapConfig.hardLimit == 0 || vm.bytesAllocated + size <= heapConfig.hardLimit) return;
+    collectFully();
+    if (vm.bytesAllocated + size > heapConfig.hardLimit) outOfMemory();
+}
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize) {
+        gcStats.bytesAllocated += newSize - oldSize;
+        if (vm.bytesAllocated > gcStats.peakHeap) gcStats.peakHeap = vm.bytesAllocated;
+    } else {
+        gcStats.bytesFreed += oldSize - newSize;
+    }
+    // Only allocations collect: a free can happen during a sweep.
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
-    }
 
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+        if (concurrentMark != NULL) {
+            // Finish a concurrent cycle once the background marker runs out of
+            // work, or right away if the heap outgrows it meanwhile.
+            if (concurrentMarkDone() || vm.bytesAllocated > (size_t) (vm.nextGC * heapConfig.growthFactor)) {
+                collectGarbage();
+            }
+        } else if (vm.bytesAllocated > vm.nextGC) {
+            collectGarbage();
+        }
+
+        if (heapConfig.hardLimit != 0 && vm.bytesAllocated > heapConfig.hardLimit) {
+            collectFully();
+            if (vm.bytesAllocated > heapConfig.hardLimit) {
+                vm.bytesAllocated -= newSize - oldSize;
+                outOfMemory();
+            }
+        }
     }
 
-    if (newSize == 0) {
+    void* result = NULL;
+    if (pointer != NULL && compactingGC && inOldSpace(pointer)) {
+        result = reallocateOld(pointer, newSize);
+    } else if (newSize == 0) {
         free(pointer);
-        return NULL;
+    } else {
+        //    realloc copies the old data over to the newly sized array and frees the
+        //    old array.
+        result = realloc(pointer, newSize);
     }
 
-    //    realloc copies the old data over to the newly sized array and frees the
-    //    old array.
-    void* result = realloc(pointer, newSize);
-    if (result == NULL)
-        exit(1);// if result == NULL that means that we ran out of memory!
+    if (result == NULL && newSize != 0) {
+        vm.bytesAllocated -= newSize - oldSize;
+        outOfMemory();
+    }
     return result;
 }
 
+void* allocateArray(size_t size) {
+    void* array = reallocate(NULL, 0, size);
+    if (heapProfiling) sampleAllocation(NULL, size);
+    return array;
+}
+
 void markObject(Obj* object) {
     if (object == NULL) {
         return;
     }
-    if (object->isMarked) {
+    if (currentMarker != NULL) {
+        markShared(object);
+        return;
+    }
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
         return;
     }
 
@@ -54,7 +115,13 @@ void markObject(Obj* object) {
 
 #endif
 
-    object->isMarked = true;
+    atomic_store_explicit(&object->isMarked, true, memory_order_relaxed);
+    // Strings reference nothing but a view's parent, and natives nothing, so there is nothing to blacken.
+    if (object->type == OBJ_STRING) {
+        markObject((Obj*) ((ObjString*) object)->parent);
+        return;
+    }
+    if (object->type == OBJ_NATIVE) return;
 
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -71,12 +138,14 @@ void markValue(Value value) {
 }
 
 static void markArray(ValueArray* array) {
+    lockHeap();
     for (int i = 0; i < array->count; i++) {
         markValue(array->values[i]);
     }
+    unlockHeap();
 }
 
-static void blackenObject(Obj* object) {
+void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*) object);
     printValue(OBJ_VAL(object));
@@ -93,7 +162,11 @@ static void blackenObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* class = (ObjClass*) object;
             markObject((Obj*) class->name);
-            markTable(&class->methods);
+            lockHeap();
+            for (int i = 0; i < class->methodCount; i++) {
+                markObject((Obj*) class->methods[i]);
+            }
+            unlockHeap();
             break;
         }
         case OBJ_CLOSURE: {
@@ -102,6 +175,25 @@ static void blackenObject(Obj* object) {
             for (int i = 0; i < closure->upvalueCount; i++) {
                 markObject((Obj*) closure->upvalues[i]);
             }
+            for (int i = 0; i < closure->superMethodCount; i++) {
+                markObject((Obj*) closure->superMethods[i]);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            if (!beginFiberScan(fiber)) break;
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(*slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject((Obj*) fiber->frames[i].closure);
+            }
+            for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                markObject((Obj*) upvalue);
+            }
+            markObject((Obj*) fiber->caller);
+            endFiberScan();
             break;
         }
         case OBJ_FUNCTION: {
@@ -116,8 +208,19 @@ static void blackenObject(Obj* object) {
             markTable(&instance->fields);
             break;
         }
+        case OBJ_LIST:
+            markArray(&((ObjList*) object)->items);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*) rope->flat);
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*) object)->closed);
+            markObject((Obj*) ((ObjUpvalue*) object)->fiber);
             break;
         case OBJ_NATIVE:
         case OBJ_STRING:
@@ -130,6 +233,8 @@ static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*) object, object->type);
 #endif
+    countFree(object->type, objectSize(object));
+    if (heapProfiling && object->profileSite != 0) releaseSample(object, objectSize(object));
 
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
@@ -138,16 +243,24 @@ static void freeObject(Obj* object) {
         }
         case OBJ_CLASS: {
             ObjClass* class = (ObjClass*) object;
-            freeTable(&class->methods);
+            FREE_ARRAY(ObjClosure*, class->methods, class->methodCount);
             FREE(ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            FREE_ARRAY(ObjClosure*, closure->superMethods, closure->superMethodCount);
             FREE(ObjClosure, object);
             break;
         }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+            FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE(ObjFiber, object);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             freeChunk(&function->chunk);
@@ -157,10 +270,12 @@ static void freeObject(Obj* object) {
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            reallocate(object, STRING_OBJ_SIZE(string), 0);
             break;
         }
         case OBJ_INSTANCE: {
@@ -169,6 +284,10 @@ static void freeObject(Obj* object) {
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_LIST:
+            freeValueArray(&((ObjList*) object)->items);
+            FREE(ObjList, object);
+            break;
         case OBJ_UPVALUE: {
             FREE(ObjUpvalue, object);
             break;
@@ -177,21 +296,22 @@ static void freeObject(Obj* object) {
 }
 
 static void markRoots() {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
-    }
-
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*) vm.frames[i].closure);
-    }
-
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*) upvalue);
+    // Flush the running fiber's registers so it is traced like any other fiber.
+    if (vm.fiber != NULL) {
+        vm.fiber->frameCount   = vm.frameCount;
+        vm.fiber->stackTop     = vm.stackTop;
+        vm.fiber->openUpvalues = vm.openUpvalues;
     }
+    markObject((Obj*) vm.fiber);
+    markObject((Obj*) vm.mainFiber);
 
     markTable(&vm.globals);
     markCompilerRoots();
+    markEventLoop();
     markObject((Obj*) vm.initString);
+    for (int i = 0; i < vm.selectorCount; i++) {
+        markObject((Obj*) vm.selectors[i]);
+    }
 }
 
 static void traceReferences() {
@@ -201,14 +321,17 @@ static void traceReferences() {
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object   = vm.objects;
+// Returns the bytes of the survivors outside the old space when compacting.
+static size_t sweep() {
+    size_t youngBytes = 0;
+    Obj* previous     = NULL;
+    Obj* object       = vm.objects;
     while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous         = object;
-            object           = object->next;
+        if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+            atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
+            if (compactingGC && !inOldSpace(object)) youngBytes += objectSize(object);
+            previous = object;
+            object   = object->next;
         } else {
             Obj* unreached = object;
             object         = object->next;
@@ -221,20 +344,53 @@ static void sweep() {
             freeObject(unreached);
         }
     }
+    return youngBytes;
 }
 
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
+    startPause();
+    size_t before = vm.bytesAllocated;
 
-    markRoots();
-    traceReferences();
+    if (concurrentMark != NULL) {
+        // The final pause of a concurrent cycle. The running stack has no
+        // barrier, so it is rescanned along with whatever is still gray.
+        stopConcurrentMark();
+        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+            markValue(*slot);
+        }
+        finishConcurrentMark();
+    } else if (concurrentMarking) {
+        // The first pause: the roots and the running stack. The background
+        // thread marks the rest, and a later call finishes the cycle.
+        beginConcurrentMark();
+        markRoots();
+        if (vm.fiber != NULL) scanFiber(vm.fiber);
+        startConcurrentMark();
+        endPause();
+        return;
+    } else if (beginParallelMark()) {
+        markRoots();
+        finishParallelMark();
+    } else {
+        markRoots();
+        traceReferences();
+    }
+    beginSweep();
     tableRemoveWhite(&vm.strings);
-    sweep();
-
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    considerCompaction(sweep());
+    endSweep();
+    endPause();
+    gcStats.collections++;
+    if (heapProfiling) heapProfileCollected();
+
+    vm.nextGC = paceCollection(before, vm.bytesAllocated);
+    // Collect early rather than grow past the soft limit, unless the survivors already fill it.
+    if (heapConfig.softLimit != 0 && vm.nextGC > heapConfig.softLimit && vm.bytesAllocated < heapConfig.softLimit) {
+        vm.nextGC = heapConfig.softLimit;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -243,12 +399,18 @@ void collectGarbage() {
 }
 
 void freeObjects() {
+    if (concurrentMark != NULL) {
+        stopConcurrentMark();
+        finishConcurrentMark();
+    }
+
     Obj* object = vm.objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+    freeOldSpace();
 
     free(vm.grayStack);
 }
@@ -17,6 +17,34 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * oldCount, 0)
 
+/*
+ * How every VM in the process sizes its heap. Set it before initVM(), from
+ * the command line or by an embedder; each VM (and so each isolate) is held
+ * to the limits on its own.
+ *
+ * initialHeap: bytes allocated before the first collection
+ * growthFactor: the next collection runs once the heap is this many times
+ *               the size that survived the last one
+ * softLimit: collect early rather than grow past this (0 for none)
+ * hardLimit: an allocation that would take the heap past this even after a
+ *            full collection is a runtime error (0 for none)
+ * targetGCShare: the share of time to spend collecting, between 0 and 1
+ *                (0 for none, see pacer.h)
+ * maxPause: the longest pause to aim for, in seconds (0 for none)
+ * logPacing: print every pacing decision to stderr
+ */
+typedef struct {
+    size_t initialHeap;
+    double growthFactor;
+    size_t softLimit;
+    size_t hardLimit;
+    double targetGCShare;
+    double maxPause;
+    bool logPacing;
+} HeapConfig;
+
+extern HeapConfig heapConfig;
+
 /*
  *  oldSize 	newSize 	            Operation
  *  0 	        Non‑zero 	            Allocate new block.
@@ -25,8 +53,19 @@
  *  Non‑zero 	Larger than oldSize 	Grow existing allocation.
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+/*
+ * Fail now, before anything is allocated, unless size more bytes fit under
+ * the hard limit. An object built from several allocations reserves them
+ * all first: running out of memory unwinds (see outOfMemory()), and would
+ * strand the pieces already allocated. Collections in between only shrink
+ * the heap, so the pieces then stay under the limit.
+ */
+void reserveMemory(size_t size);
+// A fresh array, seen by the heap profiler.
+void* allocateArray(size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
+void blackenObject(Obj* object);
 void collectGarbage();
 void freeObjects();
 
@@ -3,8 +3,12 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "gcstats.h"
+#include "heapprof.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -15,12 +19,16 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*) allocateObj(sizeof(type), objectType)
 
-static Obj* allocateObj(size_t size, ObjType type) {
-    Obj* object      = (Obj*) reallocate(NULL, 0, size);
-    object->type     = type;
-    object->isMarked = false;
-    object->next     = vm.objects;
-    vm.objects       = object;
+// Make a block of size bytes from reallocate() an object of the given type.
+static Obj* initObj(Obj* object, size_t size, ObjType type) {
+    object->type = type;
+    // Objects allocated while a background marker runs are born marked.
+    atomic_init(&object->isMarked, concurrentMark != NULL);
+    object->profileSite = 0;
+    object->next = vm.objects;
+    vm.objects   = object;
+    countAllocation(type, size);
+    if (heapProfiling) sampleAllocation(object, size);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*) object, size, type);
@@ -29,6 +37,10 @@ static Obj* allocateObj(size_t size, ObjType type) {
     return object;
 }
 
+static Obj* allocateObj(size_t size, ObjType type) {
+    return initObj((Obj*) reallocate(NULL, 0, size), size, type);
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->reciever       = receiver;
@@ -37,30 +49,73 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 }
 
 ObjClass* newClass(ObjString* name) {
-    ObjClass* class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    class->name     = name;
-    initTable(&class->methods);
+    ObjClass* class    = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+    class->name        = name;
+    class->methods     = NULL;
+    class->methodCount = 0;
     return class;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
+    reserveMemory(sizeof(ObjUpvalue*) * function->upvalueCount + sizeof(ObjClosure*) * function->superSites +
+                  sizeof(ObjClosure));
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = NULL;
     }
 
-    ObjClosure* closure   = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function     = function;
-    closure->upvalues     = upvalues;
-    closure->upvalueCount = function->upvalueCount;
+    ObjClosure** superMethods = NULL;
+    if (function->superSites > 0) {
+        superMethods = ALLOCATE(ObjClosure*, function->superSites);
+        for (int i = 0; i < function->superSites; i++) {
+            superMethods[i] = NULL;
+        }
+    }
+
+    ObjClosure* closure       = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    closure->function         = function;
+    closure->upvalues         = upvalues;
+    closure->upvalueCount     = function->upvalueCount;
+    closure->superMethods     = superMethods;
+    closure->superMethodCount = function->superSites;
     return closure;
 }
 
+ObjFiber* newFiber(ObjClosure* closure, int stackCapacity, int frameCapacity) {
+    // The arrays are not objects, so allocating them before the fiber needs no rooting.
+    reserveMemory(sizeof(Value) * stackCapacity + sizeof(CallFrame) * frameCapacity + sizeof(ObjFiber));
+    Value* stack      = ALLOCATE(Value, stackCapacity);
+    CallFrame* frames = ALLOCATE(CallFrame, frameCapacity);
+
+    ObjFiber* fiber      = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->frames        = frames;
+    fiber->frameCount    = 0;
+    fiber->frameCapacity = frameCapacity;
+    fiber->stack         = stack;
+    fiber->stackTop      = stack;
+    fiber->stackCapacity = stackCapacity;
+    fiber->openUpvalues  = NULL;
+    fiber->caller        = NULL;
+    fiber->state         = FIBER_NEW;
+    fiber->isTask        = false;
+    fiber->scanEpoch     = 0;
+
+    // Slot zero holds the callee, just like it does for any other call.
+    if (closure != NULL) {
+        *fiber->stackTop++ = OBJ_VAL(closure);
+    }
+    return fiber;
+}
+
 ObjFunction* newFunction() {
     ObjFunction* function  = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity        = 0;
     function->upvalueCount = 0;
+    function->superSites   = 0;
     function->name         = NULL;
+#ifdef DEBUG_COUNT_OPCODES
+    function->counts = NULL;
+#endif
     initChunk(&function->chunk);
     return function;
 }
@@ -72,55 +127,311 @@ ObjInstance* newInstance(ObjClass* class) {
     return instance;
 }
 
+ObjList* newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function  = function;
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint8_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString* allocateString(int length) {
+    ObjString* string = (ObjString*) reallocate(NULL, 0, STRING_SIZE(length));
     string->length    = length;
-    string->chars     = chars;
-    string->hash      = hash;
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
-
+    string->chars     = string->storage;
     return string;
 }
 
-static uint8_t hashString(const char* key, int length) {
+uint64_t hashSeed = 0;
+
+// Below this FNV-1a's one multiply per byte is fewer than the word hash's three.
+#define HASH_WORDS_MIN 4
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+// Replace a and b by the low and high halves of their 128-bit product.
+static void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) *a * *b;
+    *a                  = (uint64_t) product;
+    *b                  = (uint64_t) (product >> 64);
+#else
+    uint64_t aHigh = *a >> 32, aLow = (uint32_t) *a;
+    uint64_t bHigh = *b >> 32, bLow = (uint32_t) *b;
+    uint64_t high  = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = (uint64_t) (uint32_t) middle0 + (uint32_t) middle1 + (low >> 32);
+    *a             = low + (middle0 << 32) + (middle1 << 32);
+    *b             = high + (middle0 >> 32) + (middle1 >> 32) + (carry >> 32);
+#endif
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t read64(const char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static uint64_t read32(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/*
+ * wyhash: sixteen bytes per multiply, in three independent lanes over long
+ * strings so the multiplies overlap. Everything the seed touches goes
+ * through a full 64x64-bit multiply, which is what makes it hard to find
+ * keys that collide for a seed one does not know.
+ */
+static uint64_t hashWords(const char* key, size_t length, uint64_t seed) {
+    uint64_t a, b;
+    seed ^= mix(seed ^ HASH_P0, HASH_P1);
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t step = (length >> 3) << 2;
+            a           = read32(key) << 32 | read32(key + step);
+            b           = read32(key + length - 4) << 32 | read32(key + length - 4 - step);
+        } else if (length > 0) {
+            a = (uint64_t) (uint8_t) key[0] << 16 | (uint64_t) (uint8_t) key[length >> 1] << 8 |
+                (uint8_t) key[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        const char* p    = key;
+        size_t remaining = length;
+        if (remaining > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed  = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last sixteen bytes, overlapping ones already hashed if need be.
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+    a ^= HASH_P1;
+    b ^= seed;
+    multiply(&a, &b);
+    return mix(a ^ HASH_P0 ^ length, b ^ HASH_P1);
+}
+
+uint32_t hashString(const char* key, int length) {
+    if (length >= HASH_WORDS_MIN || hashSeed != 0) {
+        return (uint32_t) hashWords(key, (size_t) length, hashSeed);
+    }
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t) key[i];
-        hash *= 1677619;
+        hash *= 16777619;
     }
     return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint8_t hash        = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString* finishString(ObjString* string) {
+    initObj((Obj*) string, STRING_SIZE(string->length), OBJ_STRING);
+    string->hash                  = 0;
+    string->selector              = -1;
+    string->interned              = false;
+    string->parent                = NULL;
+    string->chars[string->length] = '\0';
+    return string;
+}
 
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-    return allocateString(chars, length, hash);
+// Add a string to the string table, which has none equal to it yet.
+static ObjString* addString(ObjString* string, uint32_t hash) {
+    string->hash     = hash;
+    string->interned = true;
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
+}
+
+// The string table is weak, so a lookup may find a string nothing else reaches.
+static ObjString* found(ObjString* interned) {
+    SHADE(OBJ_VAL(interned));
+    return interned;
+}
+
+ObjString* internString(ObjString* string) {
+    if (string->interned) return string;
+
+    uint32_t hash       = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, hash);
+    if (interned != NULL) return found(interned);
+    // An interned view would keep its parent alive as long as the string table does.
+    return addString(ownString(string), hash);
 }
 
 ObjString* copyString(const char* chars, int length) {
-    uint8_t hash        = hashString(chars, length);
+    uint32_t hash       = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
 
-    if (interned != NULL) return interned;
+    if (interned != NULL) return found(interned);
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return addString(finishString(string), hash);
+}
+
+static ObjString* copyChars(ObjString* string, int start, int length) {
+    push(OBJ_VAL(string));
+    ObjString* copy = allocateString(length);
+    pop();
+    memcpy(copy->chars, string->chars + start, length);
+    return finishString(copy);
+}
+
+ObjString* newView(ObjString* string, int start, int length) {
+    if (length < VIEW_MIN_LENGTH) return copyChars(string, start, length);
+
+    push(OBJ_VAL(string));
+    ObjString* view = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    pop();
+    view->length   = length;
+    view->hash     = 0;
+    view->selector = -1;
+    view->interned = false;
+    view->chars    = string->chars + start;
+    view->parent   = string->parent != NULL ? string->parent : string;
+    return view;
+}
+
+ObjString* newSubstring(ObjString* string, int start, int length) {
+    ObjString* whole = string->parent != NULL ? string->parent : string;
+    if (length < whole->length / VIEW_MIN_SHARE) return copyChars(string, start, length);
+    return newView(string, start, length);
+}
+
+ObjString* ownString(ObjString* string) {
+    return string->parent == NULL ? string : copyChars(string, 0, string->length);
+}
+
+static int textLength(Obj* text) {
+    return text->type == OBJ_STRING ? ((ObjString*) text)->length : ((ObjRope*) text)->length;
+}
+
+// A rope that has been flattened reads as its string.
+static Obj* settle(Obj* text) {
+    if (text->type == OBJ_ROPE && ((ObjRope*) text)->flat != NULL) return (Obj*) ((ObjRope*) text)->flat;
+    return text;
+}
+
+ObjRope* newRope(Obj* left, Obj* right, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length  = length;
+    rope->left    = settle(left);
+    rope->right   = settle(right);
+    rope->flat    = NULL;
+    return rope;
+}
+
+typedef struct {
+    Obj* text;
+    int offset;
+} RopePart;
+
+/*
+ * A half that is a string is copied on the way down and the walk goes on
+ * into the other one. Only a node whose halves are both ropes leaves one
+ * for later, so the lopsided ropes that + in a loop builds need no stack.
+ */
+void ropeChars(ObjRope* rope, char* chars) {
+    RopePart* pending = NULL;
+    int count         = 0;
+    int capacity      = 0;
+    Obj* text         = (Obj*) rope;
+    int offset        = 0;
+    for (;;) {
+        text = settle(text);
+        if (text->type == OBJ_STRING) {
+            memcpy(chars + offset, ((ObjString*) text)->chars, ((ObjString*) text)->length);
+            if (count == 0) break;
+            count--;
+            text   = pending[count].text;
+            offset = pending[count].offset;
+            continue;
+        }
+
+        Obj* left       = settle(((ObjRope*) text)->left);
+        Obj* right      = settle(((ObjRope*) text)->right);
+        int rightOffset = offset + textLength(left);
+        if (right->type == OBJ_STRING) {
+            memcpy(chars + rightOffset, ((ObjString*) right)->chars, ((ObjString*) right)->length);
+            text = left;
+        } else if (left->type == OBJ_STRING) {
+            memcpy(chars + offset, ((ObjString*) left)->chars, ((ObjString*) left)->length);
+            text   = right;
+            offset = rightOffset;
+        } else {
+            if (count == capacity) {
+                capacity = GROW_CAPACITY(capacity);
+                pending  = realloc(pending, sizeof(RopePart) * capacity);
+                if (pending == NULL) exit(1);
+            }
+            pending[count++] = (RopePart){right, rightOffset};
+            text             = left;
+        }
+    }
+    free(pending);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = allocateString(rope->length);
+    ropeChars(rope, string->chars);
+    finishString(string);
+
+    // A background marker may not have reached the halves yet (see marker.h).
+    SHADE(OBJ_VAL(rope->left));
+    SHADE(OBJ_VAL(rope->right));
+    rope->flat  = string;
+    rope->left  = NULL;
+    rope->right = NULL;
+    return string;
+}
+
+/*
+ * Selectors are numbered in the order names are first seen, per VM. The VM
+ * keeps every named string alive, so a name keeps its selector even when
+ * nothing else refers to it for a while.
+ */
+int internSelector(ObjString* name) {
+    if (name->selector >= 0) return name->selector;
 
-    return allocateString(heapChars, length, hash);
+    if (vm.selectorCapacity < vm.selectorCount + 1) {
+        int oldCapacity     = vm.selectorCapacity;
+        vm.selectorCapacity = GROW_CAPACITY(oldCapacity);
+        vm.selectors        = GROW_ARRAY(ObjString*, vm.selectors, oldCapacity, vm.selectorCapacity);
+    }
+    name->selector                   = vm.selectorCount;
+    vm.selectors[vm.selectorCount++] = name;
+    return name->selector;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -128,43 +439,91 @@ ObjUpvalue* newUpvalue(Value* slot) {
     upvalue->closed     = NIL_VAL;
     upvalue->location   = slot;
     upvalue->next       = NULL;
+    upvalue->fiber      = NULL;
     return upvalue;
 }
 
-static void printFunction(ObjFunction* function) {
+static int formatFunction(ObjFunction* function, char* buffer, size_t size) {
     // if function->name == NULL the "function" is the global scope
-    if (function->name == NULL) {
-        printf("<script>");
-        return;
+    if (function->name == NULL) return snprintf(buffer, size, "<script>");
+    return snprintf(buffer, size, "<fn %s>", function->name->chars);
+}
+
+// Lists nested deeper than this print as [...], which also ends one that contains itself.
+#define LIST_FORMAT_DEPTH 8
+
+static _Thread_local int listDepth = 0;
+
+static int formatList(ObjList* list, char* buffer, size_t size) {
+    if (listDepth == LIST_FORMAT_DEPTH) return snprintf(buffer, size, "[...]");
+
+    listDepth++;
+    int length = 0;
+    if (buffer != NULL) buffer[length] = '[';
+    length++;
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) {
+            if (buffer != NULL) memcpy(buffer + length, ", ", 2);
+            length += 2;
+        }
+        length += buffer == NULL ? formatValue(list->items.values[i], NULL, 0)
+                                 : formatValue(list->items.values[i], buffer + length, size - length);
     }
-    printf("<fn %s>", function->name->chars);
+    if (buffer != NULL) memcpy(buffer + length, "]", 2);
+    length++;
+    listDepth--;
+    return length;
 }
 
-void printObject(Value value) {
+int formatObject(Value value, char* buffer, size_t size) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
-            break;
+            return formatFunction(AS_BOUND_METHOD(value)->method->function, buffer, size);
         case OBJ_CLASS:
-            printf("<class %s>", AS_CLASS(value)->name->chars);
-            break;
+            return snprintf(buffer, size, "<class %s>", AS_CLASS(value)->name->chars);
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
-            break;
+            return formatFunction(AS_CLOSURE(value)->function, buffer, size);
+        case OBJ_FIBER:
+            return snprintf(buffer, size, "<fiber>");
         case OBJ_FUNCTION:
-            printFunction(AS_FUNCTION(value));
-            break;
+            return formatFunction(AS_FUNCTION(value), buffer, size);
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->class->name->chars);
-            break;
+            return snprintf(buffer, size, "%s instance", AS_INSTANCE(value)->class->name->chars);
+        case OBJ_LIST:
+            return formatList(AS_LIST(value), buffer, size);
         case OBJ_NATIVE:
-            printf("<native fn>");
-            break;
+            return snprintf(buffer, size, "<native fn>");
+        case OBJ_ROPE: {
+            ObjRope* rope = AS_ROPE(value);
+            if (buffer != NULL) {
+                ropeChars(rope, buffer);
+                buffer[rope->length] = '\0';
+            }
+            return rope->length;
+        }
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
-            break;
+            if (buffer != NULL) {
+                memcpy(buffer, AS_CSTRING(value), AS_STRING(value)->length);
+                buffer[AS_STRING(value)->length] = '\0';
+            }
+            return AS_STRING(value)->length;
         case OBJ_UPVALUE:
-            printf("upvalue");
-            break;
+            return snprintf(buffer, size, "upvalue");
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+void printObject(Value value) {
+    if (IS_STRING(value)) {
+        fwrite(AS_CSTRING(value), 1, AS_STRING(value)->length, stdout);
+        return;
+    }
+
+    char buffer[256];
+    int length = formatObject(value, NULL, 0);
+    char* text = length < (int) sizeof(buffer) ? buffer : malloc(length + 1);
+    if (text == NULL) exit(1);
+    formatObject(value, text, length + 1);
+    fwrite(text, 1, length, stdout);
+    if (text != buffer) free(text);
+}
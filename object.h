@@ -5,12 +5,14 @@
 #ifndef CLOX_OBJECT_H
 #define CLOX_OBJECT_H
 
+#include <stdatomic.h>
+
 #include "chunk.h"
 #include "table.h"
 #include "value.h"
 
 #define ALLOCATE(type, count) \
-    (type*) reallocate(NULL, 0, sizeof(type) * (count))
+    (type*) allocateArray(sizeof(type) * (count))
 
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -18,18 +20,24 @@
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*) AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*) AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*) AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*) AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*) AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*) AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*) AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative*) AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope*) AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*) AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*) AS_OBJ(value))->chars)
 
@@ -37,25 +45,42 @@ typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
+/*
+ * isMarked is atomic because marker threads (see marker.h) race to mark an
+ * object. profileSite is the heap profiler's site for a sampled object and 0
+ * for the rest (see heapprof.h).
+ */
 struct Obj {
     ObjType type;
-    bool isMarked;
+    atomic_bool isMarked;
+    uint16_t profileSite;
     struct Obj* next;
 };
 
+/*
+ * superSites is how many super expressions the function has; each has a
+ * slot in its closures' superMethods.
+ */
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int superSites;
     Chunk chunk;
     ObjString* name;
+#ifdef DEBUG_COUNT_OPCODES
+    struct FunctionCounts* counts;
+#endif
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -65,31 +90,162 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+/*
+ * The characters follow the header in the same allocation, NUL-terminated,
+ * so a string is a single block STRING_SIZE(length) long, and chars points
+ * at them.
+ *
+ * A view, made by newView(), is a string that shares another's characters:
+ * it is only the header, chars points into parent, which it keeps alive,
+ * and its characters are not NUL-terminated. parent is NULL for a string
+ * that owns its characters, and never a view itself. Code that needs a C
+ * string goes through ownString().
+ *
+ * Strings from the compiler and from copyString() are interned: vm.strings
+ * holds one string per sequence of characters, so equal interned strings
+ * are the same object. The strings a program builds as it runs
+ * (concatenation, interpolation, flattened ropes, what it reads) are not
+ * until something needs them to be: a table compares keys by identity, so
+ * a string must go through internString() before it is used as one. Until
+ * then hash is 0, and equality compares the characters.
+ *
+ * selector is the string's index into every class's method array once the
+ * compiler has seen it used as a method or property name, and -1 before
+ * (see internSelector()).
+ */
 struct ObjString {
     Obj obj;
     int length;
+    uint32_t hash;
+    int selector;
+    bool interned;
     char* chars;
-    uint8_t hash;
+    ObjString* parent;
+    char storage[];
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t) (length) + 1)
+// How big a string object is: a view's characters are its parent's.
+#define STRING_OBJ_SIZE(string) ((string)->parent != NULL ? sizeof(ObjString) : STRING_SIZE((string)->length))
+
+/*
+ * newView() copies substrings shorter than VIEW_MIN_LENGTH, for which a
+ * view saves nothing, and newSubstring() also those shorter than
+ * 1/VIEW_MIN_SHARE of the string they come from, so a short piece kept
+ * around does not keep a long string from being freed.
+ */
+#define VIEW_MIN_LENGTH 24
+#define VIEW_MIN_SHARE 8
+
+/*
+ * A rope is a concatenation not carried out yet: left and right are the
+ * strings or ropes it joins. Building a string with + in a loop then costs
+ * a small node per step instead of a copy of everything so far.
+ *
+ * The first time something needs the characters in one piece (equality, a
+ * native), flattenRope() copies them into a string, keeps it
+ * in flat and lets go of the halves, so a rope is flattened at most once.
+ * Printing and copying to another isolate walk the rope as it is.
+ * Concatenations shorter than ROPE_MIN_LENGTH are carried out right away,
+ * so both halves of a rope are never shorter than that between them.
+ */
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+#define ROPE_MIN_LENGTH 64
+
+/*
+ * An open upvalue points into the stack of the fiber that owns it and keeps
+ * that fiber (and so its stack) alive until the upvalue is closed.
+ */
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
     Value closed;
     struct ObjUpvalue* next;
+    struct ObjFiber* fiber;
 } ObjUpvalue;
 
-typedef struct {
+/*
+ * superMethods holds the method each super expression in the function
+ * resolved to, NULL until it first runs. A closure's super never changes,
+ * and a superclass's methods are all defined before any subclass exists,
+ * so the first lookup holds for the life of the closure.
+ */
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
+    struct ObjClosure** superMethods;
+    int superMethodCount;
 } ObjClosure;
 
+/*
+ * CallFrame represents an ongoing function call.
+ *
+ * function: pointer to the currently executing function
+ * ip: instruction pointer into the next bytecode instruction
+ * slots: pointer into the owning fiber's Value stack
+ *
+ */
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* ip;
+    Value* slots;
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,
+    FIBER_DONE
+} FiberState;
+
+/*
+ * A fiber is a call stack of its own: a Value stack, CallFrames and the
+ * upvalues still open on that stack. Both arrays start small and grow on
+ * demand, so idle fibers are cheap.
+ *
+ * While a fiber runs, the VM caches frameCount, stackTop and openUpvalues;
+ * the copies here are only current for fibers that are not running.
+ * caller is the fiber that resumed this one and gets control back when it
+ * yields or returns. Tasks (see eventloop.h) have no caller: the event loop
+ * decides what runs when they suspend or finish. scanEpoch records the
+ * concurrent marking cycle that last scanned the stack (see marker.h).
+ */
+typedef struct ObjFiber {
+    Obj obj;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    struct ObjFiber* caller;
+    FiberState state;
+    bool isTask;
+    unsigned long scanEpoch;
+} ObjFiber;
+
+/*
+ * methods is indexed by selector: the method named by a string whose
+ * selector is s is methods[s], or NULL if the class has none by that name.
+ * The array is methodCount long, enough for the highest selector among the
+ * class's methods, inherited ones included, so dispatch is a bounds check
+ * and a load however many classes a call site sees.
+ */
 typedef struct {
     Obj obj;
     ObjString* name;
-    Table methods;
+    ObjClosure** methods;
+    int methodCount;
 } ObjClass;
 
 typedef struct {
@@ -98,6 +254,17 @@ typedef struct {
     Table fields;
 } ObjInstance;
 
+/*
+ * The elements of a list sit side by side in items. Appending goes through
+ * writeValueArray(), which doubles the array when it is full and swaps the
+ * new one in under lockHeap(); storing into an element shades the old value
+ * first (see marker.h).
+ */
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
 typedef struct {
     Obj obj;
     Value reciever;
@@ -107,12 +274,50 @@ typedef struct {
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjFiber* newFiber(ObjClosure* closure, int stackCapacity, int frameCapacity);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* class);
+ObjList* newList();
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+/*
+ * allocateString() makes room for a string of length characters that is not
+ * yet an object: the caller writes them into chars, without allocating in
+ * between, and hands the result to finishString(), which makes it a string
+ * that is not interned. internString() interns it later if it is ever used
+ * as a key.
+ */
+ObjString* allocateString(int length);
+ObjString* finishString(ObjString* string);
+/*
+ * Strings of four bytes or more hash a word at a time, shorter ones a byte
+ * at a time. A hashSeed other than 0, set before the first VM
+ * starts, keys every hash so a script fed crafted strings cannot make them
+ * all land in one group of a table; it is the same for every isolate.
+ */
+extern uint64_t hashSeed;
+uint32_t hashString(const char* key, int length);
+// The interned string equal to string, which may be string itself but not a view.
+ObjString* internString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
+// The length characters of string from start on, as a view or a copy; the caller keeps string reachable.
+ObjString* newView(ObjString* string, int start, int length);
+ObjString* newSubstring(ObjString* string, int start, int length);
+// string, or a copy of it that owns its characters if it is a view.
+ObjString* ownString(ObjString* string);
+// left and right are strings or ropes the caller keeps reachable.
+ObjRope* newRope(Obj* left, Obj* right, int length);
+ObjString* flattenRope(ObjRope* rope);
+// Copy a rope's length characters to chars, without allocating.
+void ropeChars(ObjRope* rope, char* chars);
+// Give name a selector if it has none yet and return it.
+int internSelector(ObjString* name);
 ObjUpvalue* newUpvalue(Value* slot);
+/*
+ * Write the text print shows for an object into buffer, NUL-terminated, and
+ * return its length. buffer is NULL, to only measure, or has room for all
+ * of it: size is there for snprintf().
+ */
+int formatObject(Value value, char* buffer, size_t size);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,290 @@
+#include "common.h"
+
+#ifdef DEBUG_COUNT_OPCODES
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "opcount.h"
+
+#define OPCODE_COUNT (OP_INDEX_SET + 1)
+
+typedef enum {
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_OBJECT,
+    TYPE_COUNT,
+} OperandType;
+
+struct FunctionCounts {
+    // A copy, since the function may die before the counts are written.
+    char* name;
+    int line;
+    unsigned long calls;
+    unsigned long instructions;
+    FunctionCounts* next;
+};
+
+typedef struct {
+    // NULL for an empty slot.
+    FunctionCounts* function;
+    int offset;
+    uint8_t opcode;
+    unsigned long calls;
+    unsigned long targetChanges;
+    const void* lastTarget;
+} CallSite;
+
+typedef struct {
+    unsigned long opcodes[OPCODE_COUNT];
+    unsigned long pairs[OPCODE_COUNT][OPCODE_COUNT];
+    unsigned long types[OPCODE_COUNT][TYPE_COUNT][TYPE_COUNT];
+    int previous;
+    FunctionCounts* functions;
+    // Open addressing over (function, offset).
+    CallSite* sites;
+    int siteCount;
+    int siteCapacity;
+} OpCounts;
+
+static _Thread_local OpCounts counts = {.previous = -1};
+
+static const char* opcodeNames[OPCODE_COUNT] = {
+        [OP_CONSTANT]      = "OP_CONSTANT",
+        [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+        [OP_CASE_COMP]     = "OP_CASE_COMP",
+        [OP_NIL]           = "OP_NIL",
+        [OP_TRUE]          = "OP_TRUE",
+        [OP_FALSE]         = "OP_FALSE",
+        [OP_POP]           = "OP_POP",
+        [OP_GET_LOCAL]     = "OP_GET_LOCAL",
+        [OP_GET_GLOBAL]    = "OP_GET_GLOBAL",
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_SET_LOCAL]     = "OP_SET_LOCAL",
+        [OP_SET_GLOBAL]    = "OP_SET_GLOBAL",
+        [OP_GET_UPVALUE]   = "OP_GET_UPVALUE",
+        [OP_SET_UPVALUE]   = "OP_SET_UPVALUE",
+        [OP_GET_PROPERTY]  = "OP_GET_PROPERTY",
+        [OP_SET_PROPERTY]  = "OP_SET_PROPERTY",
+        [OP_GET_SUPER]     = "OP_GET_SUPER",
+        [OP_EQUAL]         = "OP_EQUAL",
+        [OP_GREATER]       = "OP_GREATER",
+        [OP_LESS]          = "OP_LESS",
+        [OP_ADD]           = "OP_ADD",
+        [OP_SUBTRACT]      = "OP_SUBTRACT",
+        [OP_MULTIPLY]      = "OP_MULTIPLY",
+        [OP_DIVIDE]        = "OP_DIVIDE",
+        [OP_NOT]           = "OP_NOT",
+        [OP_NEGATE]        = "OP_NEGATE",
+        [OP_PRINT]         = "OP_PRINT",
+        [OP_JUMP]          = "OP_JUMP",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_LOOP]          = "OP_LOOP",
+        [OP_CALL]          = "OP_CALL",
+        [OP_INVOKE]        = "OP_INVOKE",
+        [OP_SUPER_INVOKE]  = "OP_SUPER_INVOKE",
+        [OP_CLOSURE]       = "OP_CLOSURE",
+        [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+        [OP_RETURN]        = "OP_RETURN",
+        [OP_CLASS]         = "OP_CLASS",
+        [OP_INHERIT]       = "OP_INHERIT",
+        [OP_METHOD]        = "OP_METHOD",
+        [OP_BUILD_STRING]  = "OP_BUILD_STRING",
+        [OP_BUILD_LIST]    = "OP_BUILD_LIST",
+        [OP_INDEX_GET]     = "OP_INDEX_GET",
+        [OP_INDEX_SET]     = "OP_INDEX_SET",
+};
+
+static const char* typeNames[TYPE_COUNT] = {"nil", "bool", "number", "string", "object"};
+
+static const char* opcodeName(int opcode) {
+    return opcodeNames[opcode] != NULL ? opcodeNames[opcode] : "?";
+}
+
+static FunctionCounts* functionCounts(ObjFunction* function) {
+    if (function->counts != NULL) return function->counts;
+
+    FunctionCounts* record = calloc(1, sizeof(FunctionCounts));
+    const char* name       = function->name == NULL ? "script" : function->name->chars;
+    if (record == NULL || (record->name = strdup(name)) == NULL) exit(1);
+    record->line      = function->chunk.count > 0 ? function->chunk.lines[0] : 0;
+    record->next      = counts.functions;
+    counts.functions  = record;
+    function->counts  = record;
+    return record;
+}
+
+static OperandType operandType(Value value) {
+    if (IS_NIL(value)) return TYPE_NIL;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    if (IS_NUMBER(value)) return TYPE_NUMBER;
+    if (IS_STRING(value) || IS_ROPE(value)) return TYPE_STRING;
+    return TYPE_OBJECT;
+}
+
+// What an inline cache at a call would key on.
+static const void* callTarget(Value callee) {
+    if (!IS_OBJ(callee)) return NULL;
+    switch (OBJ_TYPE(callee)) {
+        case OBJ_CLOSURE: return functionCounts(AS_CLOSURE(callee)->function);
+        case OBJ_BOUND_METHOD: return functionCounts(AS_BOUND_METHOD(callee)->method->function);
+        case OBJ_NATIVE: return (const void*) AS_NATIVE(callee);
+        default: return AS_OBJ(callee);
+    }
+}
+
+static uint32_t hashSite(FunctionCounts* function, int offset) {
+    uint64_t hash = (uint64_t) (uintptr_t) function * 0x9E3779B97F4A7C15ull + (uint64_t) offset;
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static CallSite* findSite(CallSite* sites, int capacity, FunctionCounts* function, int offset) {
+    uint32_t slot = hashSite(function, offset) & (capacity - 1);
+    while (sites[slot].function != NULL && (sites[slot].function != function || sites[slot].offset != offset)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &sites[slot];
+}
+
+static void growSites() {
+    int capacity    = counts.siteCapacity == 0 ? 64 : counts.siteCapacity * 2;
+    CallSite* sites = calloc(capacity, sizeof(CallSite));
+    if (sites == NULL) exit(1);
+    for (int i = 0; i < counts.siteCapacity; i++) {
+        CallSite* old = &counts.sites[i];
+        if (old->function != NULL) *findSite(sites, capacity, old->function, old->offset) = *old;
+    }
+    free(counts.sites);
+    counts.sites        = sites;
+    counts.siteCapacity = capacity;
+}
+
+static void countCallSite(FunctionCounts* function, int offset, uint8_t opcode, const void* target) {
+    if ((counts.siteCount + 1) * 2 > counts.siteCapacity) growSites();
+    CallSite* site = findSite(counts.sites, counts.siteCapacity, function, offset);
+    if (site->function == NULL) {
+        *site = (CallSite){.function = function, .offset = offset, .opcode = opcode, .lastTarget = target};
+        counts.siteCount++;
+    }
+    site->calls++;
+    if (site->lastTarget != target) {
+        site->targetChanges++;
+        site->lastTarget = target;
+    }
+}
+
+void countInstruction(CallFrame* frame) {
+    uint8_t* ip              = frame->ip;
+    int opcode               = *ip;
+    FunctionCounts* function = functionCounts(frame->closure->function);
+    int offset               = (int) (ip - frame->closure->function->chunk.bcode);
+    if (opcode >= OPCODE_COUNT) return;
+
+    counts.opcodes[opcode]++;
+    if (counts.previous >= 0) counts.pairs[counts.previous][opcode]++;
+    counts.previous = opcode;
+    function->instructions++;
+
+    // The stack as the instruction is about to find it.
+    switch (opcode) {
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            counts.types[opcode][operandType(vm.stackTop[-2])][operandType(vm.stackTop[-1])]++;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            counts.types[opcode][operandType(vm.stackTop[-1])][TYPE_NIL]++;
+            break;
+        case OP_CALL: {
+            int argCount = ip[1];
+            countCallSite(function, offset, opcode, callTarget(vm.stackTop[-1 - argCount]));
+            break;
+        }
+        case OP_INVOKE: {
+            // The receiver, under the arguments.
+            Value receiver = vm.stackTop[-1 - ip[2]];
+            countCallSite(function, offset, opcode, IS_INSTANCE(receiver) ? AS_INSTANCE(receiver)->class : NULL);
+            break;
+        }
+        case OP_SUPER_INVOKE:
+            // The superclass, always the same one.
+            countCallSite(function, offset, opcode, AS_OBJ(*frame->closure->upvalues[ip[3]]->location));
+            break;
+        default:
+            break;
+    }
+}
+
+void countCall(ObjFunction* function) {
+    functionCounts(function)->calls++;
+}
+
+static FILE* openCSV(const char* directory, const char* name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    return fopen(path, "w");
+}
+
+bool writeOpCounts(const char* directory) {
+    FILE* file;
+    if ((file = openCSV(directory, "opcodes.csv")) == NULL) return false;
+    fprintf(file, "opcode,count\n");
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        fprintf(file, "%s,%lu\n", opcodeName(op), counts.opcodes[op]);
+    }
+    if (fclose(file) != 0) return false;
+
+    if ((file = openCSV(directory, "pairs.csv")) == NULL) return false;
+    fprintf(file, "first,second,count\n");
+    for (int first = 0; first < OPCODE_COUNT; first++) {
+        for (int second = 0; second < OPCODE_COUNT; second++) {
+            if (counts.pairs[first][second] == 0) continue;
+            fprintf(file, "%s,%s,%lu\n", opcodeName(first), opcodeName(second), counts.pairs[first][second]);
+        }
+    }
+    if (fclose(file) != 0) return false;
+
+    if ((file = openCSV(directory, "functions.csv")) == NULL) return false;
+    fprintf(file, "function,line,calls,instructions\n");
+    for (FunctionCounts* function = counts.functions; function != NULL; function = function->next) {
+        fprintf(file, "%s,%d,%lu,%lu\n", function->name, function->line, function->calls, function->instructions);
+    }
+    if (fclose(file) != 0) return false;
+
+    if ((file = openCSV(directory, "callsites.csv")) == NULL) return false;
+    fprintf(file, "function,line,offset,opcode,calls,targetChanges\n");
+    for (int i = 0; i < counts.siteCapacity; i++) {
+        CallSite* site = &counts.sites[i];
+        if (site->function == NULL) continue;
+        fprintf(file, "%s,%d,%d,%s,%lu,%lu\n", site->function->name, site->function->line, site->offset,
+                opcodeName(site->opcode), site->calls, site->targetChanges);
+    }
+    if (fclose(file) != 0) return false;
+
+    if ((file = openCSV(directory, "types.csv")) == NULL) return false;
+    fprintf(file, "opcode,left,right,count\n");
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        for (int left = 0; left < TYPE_COUNT; left++) {
+            for (int right = 0; right < TYPE_COUNT; right++) {
+                if (counts.types[op][left][right] == 0) continue;
+                // Unary operators have no right operand.
+                bool unary = op == OP_NOT || op == OP_NEGATE;
+                fprintf(file, "%s,%s,%s,%lu\n", opcodeName(op), typeNames[left], unary ? "" : typeNames[right],
+                        counts.types[op][left][right]);
+            }
+        }
+    }
+    return fclose(file) == 0;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CLOX_OPCOUNT_H
+#define CLOX_OPCOUNT_H
+
+#include "vm.h"
+
+/*
+ * Execution counters for deciding what to specialise in the interpreter,
+ * built only with DEBUG_COUNT_OPCODES (see common.h). run() reports every
+ * instruction before it executes and call() every call, and the counters
+ * are kept per VM:
+ *
+ *   opcodes.csv    executions of each opcode
+ *   pairs.csv      executions of each opcode followed by another
+ *   functions.csv  calls and instructions executed per function
+ *   callsites.csv  calls per call instruction, and how often the callee
+ *                  (or the receiver's class, for invokes) differed from the
+ *                  one before, which is what an inline cache would miss
+ *   types.csv      operand types seen by arithmetic and comparisons
+ *
+ * A function is known by its name and first line, so that its counts
+ * outlive it and follow it through compaction.
+ */
+
+typedef struct FunctionCounts FunctionCounts;
+
+void countInstruction(CallFrame* frame);
+void countCall(ObjFunction* function);
+// Write the CSV files into directory; false if one could not be written.
+bool writeOpCounts(const char* directory);
+
+#endif// CLOX_OPCOUNT_H
@@ -0,0 +1,107 @@
+#include <stdio.h>
+
+#include "cpuprof.h"
+#include "gcstats.h"
+#include "memory.h"
+#include "pacer.h"
+
+// Never leave less headroom than this, nor less than an eighth of what survived.
+#define HEADROOM_MIN (256 * 1024)
+// Nor let the heap grow past this many times what survived.
+#define GROWTH_MAX 8
+// The weight a new measurement gets in its moving average.
+#define SMOOTHING 0.5
+
+typedef struct {
+    double pauseStart;
+    // Time stopped so far in the running cycle.
+    double cyclePause;
+    double lastCycleEnd;
+    size_t lastLive;
+    // Bytes per second the program allocates while it runs.
+    double allocationRate;
+    // Seconds of pause per byte of heap.
+    double costPerByte;
+    double survival;
+    bool measured;
+} Pacer;
+
+static _Thread_local Pacer pacer;
+
+static double average(double old, double sample, bool measured) {
+    return measured ? old + SMOOTHING * (sample - old) : sample;
+}
+
+void initPacer() {
+    pacer = (Pacer){0};
+    pacer.lastCycleEnd = gcClock();
+}
+
+void startPause() {
+    cpuProfileInGC   = 1;
+    pacer.pauseStart = gcClock();
+}
+
+void endPause() {
+    double pause = gcClock() - pacer.pauseStart;
+    pacer.cyclePause += pause;
+    recordPause(pause);
+    cpuProfileInGC = 0;
+}
+
+size_t paceCollection(size_t before, size_t live) {
+    double end     = gcClock();
+    double pause   = pacer.cyclePause;
+    double running = end - pacer.lastCycleEnd - pause;
+    if (before > 0 && running > 0) {
+        size_t allocated     = before > pacer.lastLive ? before - pacer.lastLive : 0;
+        pacer.allocationRate = average(pacer.allocationRate, allocated / running, pacer.measured);
+        pacer.costPerByte    = average(pacer.costPerByte, pause / before, pacer.measured);
+        pacer.survival       = average(pacer.survival, (double) live / before, pacer.measured);
+        pacer.measured       = true;
+    }
+    pacer.cyclePause   = 0;
+    pacer.lastCycleEnd = end;
+    pacer.lastLive     = live;
+
+    double headroom    = live * (heapConfig.growthFactor - 1);
+    const char* reason = "growth factor";
+    if (pacer.measured && (heapConfig.targetGCShare > 0 || heapConfig.maxPause > 0)) {
+        double ceiling = (double) live * (GROWTH_MAX - 1);
+        headroom       = ceiling;
+        reason         = "ceiling";
+
+        if (heapConfig.targetGCShare > 0) {
+            // Solve k * (live + h) / (k * (live + h) + h / r) = share for h.
+            double share = heapConfig.targetGCShare;
+            double a     = pacer.costPerByte * pacer.allocationRate * (1 - share) / share;
+            if (a < 1 && a * live / (1 - a) < headroom) {
+                headroom = a * live / (1 - a);
+                reason   = "GC share";
+            }
+        }
+        if (heapConfig.maxPause > 0 && pacer.costPerByte > 0) {
+            double fits = heapConfig.maxPause / pacer.costPerByte - live;
+            if (fits < headroom) {
+                headroom = fits;
+                reason   = "pause target";
+            }
+        }
+
+        double floor = live / 8.0 > HEADROOM_MIN ? live / 8.0 : HEADROOM_MIN;
+        if (headroom < floor) {
+            headroom = floor;
+            reason   = "floor";
+        }
+    }
+
+    size_t next = live + (size_t) headroom;
+    if (heapConfig.logPacing) {
+        fprintf(stderr,
+                "[gc pacer] %zu -> %zu bytes (%.0f%% survived, avg %.0f%%), pause %.3fms, "
+                "allocating %.1f MB/s, next at %zu (%s)\n",
+                before, live, before > 0 ? 100.0 * live / before : 0.0, 100 * pacer.survival,
+                pause * 1000, pacer.allocationRate / (1024 * 1024), next, reason);
+    }
+    return next;
+}
@@ -0,0 +1,37 @@
+#ifndef CLOX_PACER_H
+#define CLOX_PACER_H
+
+#include "common.h"
+
+/*
+ * The pacer decides when the next collection starts. Left alone it keeps
+ * the old rule: collect once the heap is growthFactor times what survived.
+ * Given a target in heapConfig (see memory.h) it sizes the headroom, the
+ * bytes the program may allocate before the next collection, from what it
+ * has measured instead:
+ *
+ * - the allocation rate, in bytes per second of running the program,
+ * - the cost of a collection per byte of heap, from the pauses so far,
+ * - the survival ratio, the share of the heap a collection keeps.
+ *
+ * targetGCShare bounds the share of time spent collecting: with a cost k
+ * per byte and an allocation rate r, a heap of live + headroom bytes takes
+ * k * (live + headroom) to collect and headroom / r to fill again. maxPause
+ * bounds k * (live + headroom) on its own. Where both are set the smaller
+ * headroom wins. A pause only counts the time the program is stopped, so
+ * the work of a background marker (see marker.h) is free as far as the
+ * pacer knows.
+ *
+ * Every measurement is a moving average, so one odd collection cannot throw
+ * the heap size around. With logPacing every decision goes to stderr.
+ */
+
+void initPacer();
+// The program stops for the collector. A concurrent cycle stops it twice.
+void startPause();
+void endPause();
+// Pick the heap size that starts the next collection. before is the heap
+// when the cycle finished marking, live what the sweep left of it.
+size_t paceCollection(size_t before, size_t live);
+
+#endif// CLOX_PACER_H
@@ -6,20 +6,27 @@
 #include <stdio.h>
 #include <string.h>
 
+#define INTERPOLATION_MAX 8
+
 typedef struct {
     //    start points to the current lexeme
     const char* start;
     //  current points to the current char
     const char* current;
     int line;
+    // The "${"s still open, innermost last, each with the braces opened inside it.
+    int braces[INTERPOLATION_MAX];
+    int interpolationCount;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void initScanner(const char* source) {
     scanner.start   = source;
     scanner.current = source;
     scanner.line    = 1;
+
+    scanner.interpolationCount = 0;
 }
 
 static bool isAlpha(char c) {
@@ -186,8 +193,23 @@ static Token number() {
     return makeToken(TOKEN_NUMBER);
 }
 
+/*
+ * Scan the rest of a string, from its opening quote or from the "}" that
+ * closes an interpolation. Both lexemes have one character in front of the
+ * text: a TOKEN_STRING ends with the closing quote, a TOKEN_INTERPOLATION
+ * with the "${" that opens the next expression.
+ */
 static Token string() {
     while (peek() != '"' && !isAtEnd()) {
+        if (peek() == '$' && peekNext() == '{') {
+            if (scanner.interpolationCount == INTERPOLATION_MAX) {
+                return errorToken("Interpolation nested too deeply");
+            }
+            advance();
+            advance();
+            scanner.braces[scanner.interpolationCount++] = 0;
+            return makeToken(TOKEN_INTERPOLATION);
+        }
         if (peek() == '\n') scanner.line++;
         advance();
     }
@@ -225,11 +247,24 @@ Token scanToken() {
         case ')':
             return makeToken(TOKEN_RIGHT_PAREN);
         case '{':
+            if (scanner.interpolationCount > 0) scanner.braces[scanner.interpolationCount - 1]++;
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
+            if (scanner.interpolationCount > 0) {
+                // The brace that closes the interpolation resumes its string.
+                if (scanner.braces[scanner.interpolationCount - 1] == 0) {
+                    scanner.interpolationCount--;
+                    return string();
+                }
+                scanner.braces[scanner.interpolationCount - 1]--;
+            }
             return makeToken(TOKEN_RIGHT_BRACE);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
@@ -12,6 +12,8 @@ typedef enum {
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -31,6 +33,8 @@ typedef enum {
     // Literals.
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
+    // The part of a string up to a "${": "a${, or }b${ after a previous one.
+    TOKEN_INTERPOLATION,
     TOKEN_NUMBER,
     // Keywords.
     TOKEN_AND,
@@ -5,96 +5,301 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Seven eighths, as a group always has room to spare.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+// Below an eighth full, a table shrinks. Growing leaves it at least 7/16 full.
+#define TABLE_MIN_LOAD(capacity) ((capacity) / 8)
+#define TABLE_MIN_CAPACITY 8
+
+// A full slot's control byte is H2() of its key's hash, so its top bit is clear.
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t) ((hash) & 0x7F))
+
+// Bit i is set for slot i of a group.
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte)));
+}
+
+// Empty and deleted slots are the ones with the top bit set.
+static inline GroupMask matchFree(const uint8_t* group) {
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+#else
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchByte(group, CTRL_EMPTY);
+}
+
+static inline int groupMask(int capacity) {
+    return capacity <= GROUP_SIZE ? 0 : capacity / GROUP_SIZE - 1;
+}
+
+// The slots of a group that exist; only a table smaller than a group has fewer.
+static inline GroupMask validSlots(int capacity) {
+    return capacity < GROUP_SIZE ? (1u << capacity) - 1 : (1u << GROUP_SIZE) - 1;
+}
 
 void initTable(Table* table) {
-    table->count    = 0;
-    table->capacity = 0;
-    table->entries  = NULL;
+    table->count      = 0;
+    table->tombstones = 0;
+    table->capacity   = 0;
+    table->shrink     = false;
+    table->entries    = NULL;
 }
+
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->count);
+    if (table->entries != NULL) FREE_ARRAY(uint8_t, table->entries, TABLE_BYTES(table->capacity));
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index   = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            if (tombstone == NULL) tombstone = entry;
-        } else if (entry->key == key) {
-            return entry;
+/*
+ * The slot holding key, or -1. Groups are visited in triangular order
+ * (1, 2, 3... groups on from the last), which reaches every group of a
+ * power-of-two table, and the search ends at the first group with an empty
+ * slot: an insertion would have stopped there.
+ */
+static int findSlot(Entry* entries, int capacity, ObjString* key) {
+    uint8_t* control = TABLE_CONTROL(entries, capacity);
+    int mask         = groupMask(capacity);
+    int group        = H1(key->hash) & mask;
+    for (int step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        for (GroupMask match = matchByte(bytes, H2(key->hash)); match != 0; match &= match - 1) {
+            int slot = group * GROUP_SIZE + __builtin_ctz(match);
+            if (entries[slot].key == key) return slot;
         }
+        if (matchEmpty(bytes) != 0) return -1;
+        group = (group + step) & mask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// The first empty or deleted slot on key's probe sequence.
+static int findFreeSlot(Entry* entries, int capacity, uint32_t hash) {
+    uint8_t* control = TABLE_CONTROL(entries, capacity);
+    int mask         = groupMask(capacity);
+    int group        = H1(hash) & mask;
+    for (int step = 1;; step++) {
+        GroupMask freeSlots = matchFree(control + group * GROUP_SIZE) & validSlots(capacity);
+        if (freeSlots != 0) return group * GROUP_SIZE + __builtin_ctz(freeSlots);
+        group = (group + step) & mask;
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->capacity == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table->entries, table->capacity, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
-
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = allocateArray(TABLE_BYTES(capacity));
     for (int i = 0; i < capacity; i++) {
         entries[i].key   = NULL;
         entries[i].value = NIL_VAL;
     }
+    uint8_t* control = TABLE_CONTROL(entries, capacity);
+    memset(control, CTRL_EMPTY, TABLE_BYTES(capacity) - capacity * sizeof(Entry));
 
-    table->count = 0;
+    // Deleted slots are left behind.
+    table->count      = 0;
+    table->tombstones = 0;
+    table->shrink     = false;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key   = entry->key;
-        dest->value = entry->value;
+        int slot      = findFreeSlot(entries, capacity, entry->key->hash);
+        control[slot] = H2(entry->key->hash);
+        entries[slot] = *entry;
+        table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries  = entries;
-    table->capacity = capacity;
+    // A background marker may be reading the old entries (see marker.h).
+    lockHeap();
+    Entry* oldEntries = table->entries;
+    int oldCapacity   = table->capacity;
+    table->entries    = entries;
+    table->capacity   = capacity;
+    unlockHeap();
+    if (oldEntries != NULL) FREE_ARRAY(uint8_t, oldEntries, TABLE_BYTES(oldCapacity));
+}
+
+/*
+ * Put every entry back where a probe for it now starts, without
+ * allocating: deleted slots become empty and the full ones are marked
+ * deleted until placed. Each is moved to the first free slot on its probe
+ * sequence, swapping with an entry still waiting to be placed if need be.
+ */
+static void rehashInPlace(Table* table) {
+    Entry* entries   = table->entries;
+    int capacity     = table->capacity;
+    uint8_t* control = TABLE_CONTROL(entries, capacity);
+
+    // Entries change places, which a background marker must not see halfway.
+    lockHeap();
+    for (int i = 0; i < capacity; i++) {
+        control[i] = control[i] & 0x80 ? CTRL_EMPTY : CTRL_DELETED;
+    }
+    for (int i = 0; i < capacity; i++) {
+        if (control[i] != CTRL_DELETED) continue;
+
+        uint32_t hash = entries[i].key->hash;
+        int slot      = findFreeSlot(entries, capacity, hash);
+        // Already in the group a probe would reach first.
+        if (slot / GROUP_SIZE == i / GROUP_SIZE) {
+            control[i] = H2(hash);
+            continue;
+        }
+
+        if (control[slot] == CTRL_EMPTY) {
+            entries[slot]    = entries[i];
+            entries[i].key   = NULL;
+            entries[i].value = NIL_VAL;
+            control[i]       = CTRL_EMPTY;
+            control[slot]    = H2(hash);
+        } else {
+            Entry waiting = entries[slot];
+            entries[slot] = entries[i];
+            entries[i]    = waiting;
+            control[slot] = H2(hash);
+            // Place the entry swapped in next.
+            i--;
+        }
+    }
+    unlockHeap();
+    table->tombstones = 0;
+}
+
+// The smallest capacity at which count entries fill half the maximum load.
+static int capacityFor(int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (TABLE_MAX_LOAD(capacity) / 2 < count) capacity *= 2;
+    return capacity;
+}
+
+static void shrinkIfSparse(Table* table, int count) {
+    if (count >= TABLE_MIN_LOAD(table->capacity)) return;
+    int capacity = capacityFor(count);
+    if (capacity < table->capacity) adjustCapacity(table, capacity);
+}
+
+// Make sure there is a free slot for one more entry.
+static void makeRoom(Table* table) {
+    int count = table->count + 1;
+    if (table->shrink) {
+        table->shrink = false;
+        shrinkIfSparse(table, count);
+    }
+    if (count + table->tombstones <= TABLE_MAX_LOAD(table->capacity)) return;
+
+    // Mostly tombstones: clearing them makes enough room.
+    if (count <= TABLE_MAX_LOAD(table->capacity) / 2) {
+        rehashInPlace(table);
+    } else {
+        adjustCapacity(table, GROW_CAPACITY(table->capacity));
+    }
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    makeRoom(table);
+
+    // One pass looks for the key and for the first slot it could go in.
+    Entry* entries   = table->entries;
+    uint8_t* control = TABLE_CONTROL(entries, table->capacity);
+    int mask         = groupMask(table->capacity);
+    int group        = H1(key->hash) & mask;
+    int freeSlot     = -1;
+    for (int step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        for (GroupMask match = matchByte(bytes, H2(key->hash)); match != 0; match &= match - 1) {
+            Entry* entry = &entries[group * GROUP_SIZE + __builtin_ctz(match)];
+            if (entry->key == key) {
+                SHADE(entry->value);
+                entry->value = value;
+                return false;
+            }
+        }
+        GroupMask freeSlots = matchFree(bytes) & validSlots(table->capacity);
+        if (freeSlot < 0 && freeSlots != 0) freeSlot = group * GROUP_SIZE + __builtin_ctz(freeSlots);
+        if (matchEmpty(bytes) != 0) break;
+        group = (group + step) & mask;
     }
-    Entry* entry  = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-    entry->key   = key;
-    entry->value = value;
-    return isNewKey;
+    if (control[freeSlot] == CTRL_DELETED) table->tombstones--;
+    table->count++;
+    control[freeSlot]       = H2(key->hash);
+    entries[freeSlot].key   = key;
+    entries[freeSlot].value = value;
+    return true;
+}
+
+/*
+ * A slot can go back to empty when its group already has an empty slot,
+ * since then no probe has ever gone on past the group. Otherwise it is
+ * marked deleted and left for a rehash to clear.
+ */
+static void deleteSlot(Table* table, int slot) {
+    uint8_t* control = TABLE_CONTROL(table->entries, table->capacity);
+    Entry* entry     = &table->entries[slot];
+    SHADE(OBJ_VAL(entry->key));
+    SHADE(entry->value);
+    entry->key   = NULL;
+    entry->value = NIL_VAL;
+
+    table->count--;
+    if (matchEmpty(control + slot / GROUP_SIZE * GROUP_SIZE) != 0) {
+        control[slot] = CTRL_EMPTY;
+    } else {
+        control[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table->entries, table->capacity, key);
+    if (slot < 0) return false;
 
-    entry->key   = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, slot);
+    shrinkIfSparse(table, table->count);
     return true;
 }
 
@@ -110,32 +315,44 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    Entry* entries   = table->entries;
+    uint8_t* control = TABLE_CONTROL(entries, table->capacity);
+    int mask         = groupMask(table->capacity);
+    int group        = H1(hash) & mask;
+    for (int step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        for (GroupMask match = matchByte(bytes, H2(hash)); match != 0; match &= match - 1) {
+            ObjString* key = entries[group * GROUP_SIZE + __builtin_ctz(match)].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
-
-        index = (index + 1) & (table->capacity - 1);
+        if (matchEmpty(bytes) != 0) return NULL;
+        group = (group + step) & mask;
     }
 }
 
 void tableRemoveWhite(Table* table) {
+    // Nothing else deletes, so this is as full as it got since the last purge.
+    bool sparse = table->count < TABLE_MIN_LOAD(table->capacity);
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (entry->key != NULL && !atomic_load_explicit(&entry->key->obj.isMarked, memory_order_relaxed)) {
+            deleteSlot(table, i);
         }
     }
+    // This runs during a collection, which must not allocate, so shrinking
+    // is left to the next tableSet().
+    if (table->tombstones > TABLE_MIN_LOAD(table->capacity)) rehashInPlace(table);
+    table->shrink = sparse;
 }
 
 void markTable(Table* table) {
+    lockHeap();
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         markObject((Obj*) entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+    unlockHeap();
+}
@@ -13,12 +13,44 @@ typedef struct {
     Value value;
 } Entry;
 
+/*
+ * An open-addressing table probed a group of GROUP_SIZE slots at a time
+ * (the Swiss table layout). Next to the entries is an array of control
+ * bytes, one per slot: the low seven bits of the key's hash when the slot
+ * is full, or EMPTY or DELETED. A lookup compares the control bytes of a
+ * whole group with the key's bits at once (with SSE2 where there is SSE2)
+ * and only looks at the entries whose bits match, so most misses and most
+ * collisions never touch an Entry. The rest of the hash picks the group
+ * to start at.
+ *
+ * The control bytes follow the entries in the same block, so a table has
+ * one allocation, TABLE_BYTES(capacity) long. A table smaller than a group
+ * still has a whole group of control bytes, the ones past its capacity
+ * always EMPTY. Empty and deleted slots have a NULL key, so code that only
+ * walks the entries (markTable(), compaction) never needs the control
+ * bytes.
+ *
+ * count is the live entries and tombstones the deleted slots. Both lengthen
+ * probes, so the load factor limits the two together; tombstones are
+ * cleared by rehashing in place. A table left mostly empty by tableDelete()
+ * shrinks right away. One purged by tableRemoveWhite() shrinks at its next
+ * tableSet(), and only if it was mostly empty before the purge as well:
+ * the intern table refills between collections, and shrinking it after
+ * every one would only mean growing it again.
+ */
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
+    bool shrink;
     Entry* entries;
 } Table;
 
+#define GROUP_SIZE 16
+#define TABLE_CONTROL(entries, capacity) ((uint8_t*) ((entries) + (capacity)))
+#define TABLE_BYTES(capacity) \
+    ((size_t) (capacity) * sizeof(Entry) + ((capacity) < GROUP_SIZE ? GROUP_SIZE : (capacity)))
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "object.h"
+#include "text.h"
+#include "vm.h"
+
+// Whether value is a whole number from 0 to limit, which it then stores in position.
+static bool toPosition(Value value, int limit, int* position) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    if (number < 0 || number > limit || number != (int) number) return false;
+    *position = (int) number;
+    return true;
+}
+
+Value substringNative(int argCount, Value* args) {
+    int start;
+    int end = 0;
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) ||
+        !toPosition(args[1], AS_STRING(args[0])->length, &start) ||
+        (argCount == 3 && !toPosition(args[2], AS_STRING(args[0])->length, &end)) ||
+        (argCount == 3 && end < start)) {
+        runtimeError("substring() expects a string and a range within it.");
+        return NIL_VAL;
+    }
+
+    ObjString* string = AS_STRING(args[0]);
+    if (argCount == 2) end = string->length;
+    if (start == 0 && end == string->length) return args[0];
+    return OBJ_VAL(newSubstring(string, start, end - start));
+}
+
+Value indexOfNative(int argCount, Value* args) {
+    int from = 0;
+    if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) || !IS_STRING(args[1]) ||
+        (argCount == 3 && !toPosition(args[2], AS_STRING(args[0])->length, &from))) {
+        runtimeError("indexOf() expects two strings and an optional position.");
+        return NIL_VAL;
+    }
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* part   = AS_STRING(args[1]);
+    const char* found;
+    if (part->length == 1) {
+        found = memchr(string->chars + from, part->chars[0], string->length - from);
+    } else {
+        found = memmem(string->chars + from, string->length - from, part->chars, part->length);
+    }
+    return NUMBER_VAL(found == NULL ? -1 : found - string->chars);
+}
+
+Value charAtNative(int argCount, Value* args) {
+    int index;
+    if (argCount != 2 || !IS_STRING(args[0]) || !toPosition(args[1], AS_STRING(args[0])->length - 1, &index)) {
+        runtimeError("charAt() expects a string and a position within it.");
+        return NIL_VAL;
+    }
+
+    // Interned, so going through a string one character at a time allocates
+    // only the first time each character comes up.
+    return OBJ_VAL(copyString(AS_STRING(args[0])->chars + index, 1));
+}
+
+Value splitNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1]) || AS_STRING(args[1])->length == 0) {
+        runtimeError("split() expects a string and a separator that is not empty.");
+        return NIL_VAL;
+    }
+
+    ObjString* string    = AS_STRING(args[0]);
+    ObjString* separator = AS_STRING(args[1]);
+    ObjList* pieces      = newList();
+    push(OBJ_VAL(pieces));
+
+    int start = 0;
+    for (;;) {
+        const char* end  = memmem(string->chars + start, string->length - start, separator->chars,
+                                  separator->length);
+        int length       = end == NULL ? string->length - start : (int) (end - string->chars) - start;
+        ObjString* piece = newView(string, start, length);
+        push(OBJ_VAL(piece));
+        writeValueArray(&pieces->items, OBJ_VAL(piece));
+        pop();
+        if (end == NULL) break;
+        start += length + separator->length;
+    }
+
+    pop();
+    return OBJ_VAL(pieces);
+}
@@ -0,0 +1,27 @@
+#ifndef CLOX_TEXT_H
+#define CLOX_TEXT_H
+
+#include "value.h"
+
+/*
+ * Natives for taking strings apart. Positions count bytes from 0, and a
+ * range is from start up to but not including end.
+ *
+ * A piece of a string is a view of it where that pays (see newView()):
+ * it shares the string's characters instead of copying them. substring()
+ * copies a piece that is short next to the whole string, so keeping it
+ * does not keep the rest alive; split() does not, since its pieces
+ * together cover the whole string anyway.
+ *
+ * substring(s, start, end)  end defaults to the length of s
+ * indexOf(s, part, from)    the first position of part from from (0 by
+ *                           default) on, or -1
+ * charAt(s, i)              the one-character string at i
+ * split(s, separator)       a list of the pieces between separators
+ */
+Value substringNative(int argCount, Value* args);
+Value indexOfNative(int argCount, Value* args);
+Value charAtNative(int argCount, Value* args);
+Value splitNative(int argCount, Value* args);
+
+#endif// CLOX_TEXT_H
@@ -2,6 +2,7 @@
 // Created by dylan on 11/5/23.
 //
 #include "value.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
 #include <stdio.h>
@@ -14,14 +15,26 @@ void initValueArray(ValueArray* array) {
 }
 
 void writeValueArray(ValueArray* array, Value value) {
-    if (array->capacity < array->count + 1) {
-        int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values =
-                GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    int oldCapacity  = array->capacity;
+    int capacity     = oldCapacity;
+    Value* oldValues = array->values;
+    Value* values    = oldValues;
+    if (capacity < array->count + 1) {
+        capacity = GROW_CAPACITY(oldCapacity);
+        values   = ALLOCATE(Value, capacity);
+        if (array->count > 0) memcpy(values, oldValues, sizeof(Value) * array->count);
     }
+
+    // A background marker may be reading the array (see marker.h). It must
+    // never see a count that takes in a slot not written yet, nor a new
+    // count with the old values.
+    lockHeap();
+    array->values               = values;
+    array->capacity             = capacity;
     array->values[array->count] = value;
     array->count++;
+    unlockHeap();
+    if (values != oldValues) FREE_ARRAY(Value, oldValues, oldCapacity);
 }
 
 void freeValueArray(ValueArray* array) {
@@ -58,12 +71,28 @@ void printValue(Value value) {
 #endif
 }
 
+int formatValue(Value value, char* buffer, size_t size) {
+    if (IS_BOOL(value)) return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+    if (IS_NIL(value)) return snprintf(buffer, size, "nil");
+    if (IS_NUMBER(value)) return snprintf(buffer, size, "%g", AS_NUMBER(value));
+    return formatObject(value, buffer, size);
+}
+
+// Equal interned strings are the same string; only one not interned has to be read.
+static bool stringsEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b)) return false;
+    ObjString* left  = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    if (left->interned && right->interned) return false;
+    return left->length == right->length && memcmp(left->chars, right->chars, left->length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    return a == b || stringsEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -72,7 +101,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
         case VAL_NIL:
             return true;
         default:
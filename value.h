@@ -99,5 +99,7 @@ void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+// The same text as a string, formatObject() style (see object.h).
+int formatValue(Value value, char* buffer, size_t size);
 
 #endif// CLOX_VALUE_H
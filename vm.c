@@ -10,18 +10,25 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "compact.h"
 #include "compiler.h"
+#include "cpuprof.h"
 #include "debug.h"
+#include "eventloop.h"
+#include "gcstats.h"
+#include "isolate.h"
+#include "marker.h"
 #include "memory.h"
+#include "opcount.h"
+#include "pacer.h"
 #include "table.h"
+#include "text.h"
 #include "value.h"
 #include "vm.h"
 
 #include <stdlib.h>
 
-VM vm;
-
-static void runtimeError(const char* format, ...);
+_Thread_local VM vm;
 
 static Value clockNative(int argCount, Value* args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
@@ -43,7 +50,8 @@ static Value reflectFieldNative(int argCount, Value* args) {
         exit(1);
     }
 
-    ObjString* fieldName = AS_STRING(*args);
+    // Field names are table keys.
+    ObjString* fieldName = internString(AS_STRING(*args));
     Value value;
     if (!tableGet(&instance->fields, fieldName, &value)) {
         return NIL_VAL;
@@ -51,21 +59,75 @@ static Value reflectFieldNative(int argCount, Value* args) {
     return value;
 }
 
+// Add value to the end of list, in amortized constant time.
+static Value appendNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_LIST(args[0])) {
+        runtimeError("append() expects a list and a value.");
+        return NIL_VAL;
+    }
+    writeValueArray(&AS_LIST(args[0])->items, args[1]);
+    return NIL_VAL;
+}
+
+// How many elements a list has, or characters a string.
+static Value lenNative(int argCount, Value* args) {
+    if (argCount == 1 && IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (argCount == 1 && IS_STRING(args[0])) return NUMBER_VAL(AS_STRING(args[0])->length);
+    runtimeError("len() expects a list or a string.");
+    return NIL_VAL;
+}
+
+static Value fiberNative(int argCount, Value* args);
+static Value resumeNative(int argCount, Value* args);
+static Value yieldNative(int argCount, Value* args);
+static Value isDoneNative(int argCount, Value* args);
+
+/*
+ * Make `fiber` the running fiber. Only the registers cached in the VM are
+ * saved and loaded; both stacks stay where they are.
+ */
+void switchFiber(ObjFiber* fiber) {
+    ObjFiber* current     = vm.fiber;
+    current->frameCount   = vm.frameCount;
+    current->stackTop     = vm.stackTop;
+    current->openUpvalues = vm.openUpvalues;
+
+    vm.fiber        = fiber;
+    vm.frames       = fiber->frames;
+    vm.frameCount   = fiber->frameCount;
+    vm.stack        = fiber->stack;
+    vm.stackTop     = fiber->stackTop;
+    vm.openUpvalues = fiber->openUpvalues;
+    vm.switchCount++;
+
+    // Stacks have no write barrier, so a concurrent cycle scans a fiber before it runs.
+    if (concurrentMark != NULL) scanFiber(fiber);
+}
+
 static void resetStack() {
+    // Unwinding abandons every fiber between the running one and the main fiber.
+    ObjFiber* fiber = vm.fiber;
+    while (fiber != NULL && fiber != vm.mainFiber) {
+        ObjFiber* caller = fiber->caller;
+        fiber->state     = FIBER_DONE;
+        fiber->caller    = NULL;
+        fiber            = caller;
+    }
+    if (concurrentMark != NULL) scanFiber(vm.mainFiber);
+
+    vm.fiber        = vm.mainFiber;
+    vm.frames       = vm.mainFiber->frames;
+    vm.stack        = vm.mainFiber->stack;
     vm.stackTop     = vm.stack;
     vm.frameCount   = 0;
     vm.openUpvalues = NULL;
+    // Tasks left behind by an error never run.
+    resetEventLoop();
 }
 
-static void runtimeError(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
-
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame      = &vm.frames[i];
+static void printStackTrace(CallFrame* frames, int frameCount) {
+    for (int i = frameCount - 1; i >= 0; i--) {
+        CallFrame* frame      = &frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction    = frame->ip - function->chunk.bcode - 1;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
@@ -75,6 +137,19 @@ static void runtimeError(const char* format, ...) {
             fprintf(stderr, "%s()\n", function->name->chars);
         }
     }
+}
+
+void runtimeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    printStackTrace(vm.frames, vm.frameCount);
+    for (ObjFiber* fiber = vm.fiber->caller; fiber != NULL; fiber = fiber->caller) {
+        printStackTrace(fiber->frames, fiber->frameCount);
+    }
     resetStack();
 }
 
@@ -87,29 +162,79 @@ static void defineNative(const char* name, NativeFn function) {
 }
 
 void initVM() {
-    resetStack();
+    vm.fiber          = NULL;
+    vm.mainFiber      = NULL;
+    vm.switchCount    = 0;
+#ifdef CLOX_BENCH
+    vm.instructionCount = 0;
+    vm.isolatePeakHeap  = 0;
+#endif
+    vm.unwind         = NULL;
     vm.objects        = NULL;
     vm.bytesAllocated = 0;
-    vm.nextGC         = 1024 * 1024;
+    vm.nextGC         = heapConfig.initialHeap;
+    if (heapConfig.softLimit != 0 && vm.nextGC > heapConfig.softLimit) vm.nextGC = heapConfig.softLimit;
+    initPacer();
+    initGCStats();
 
     vm.grayCount    = 0;
     vm.grayCapacity = 0;
     vm.grayStack    = NULL;
     initTable(&vm.globals);
     initTable(&vm.strings);
+    vm.initString       = NULL;
+    vm.selectors        = NULL;
+    vm.selectorCount    = 0;
+    vm.selectorCapacity = 0;
+
+    vm.mainFiber        = newFiber(NULL, STACK_MAX, FRAMES_MAX);
+    vm.mainFiber->state = FIBER_RUNNING;
+    resetStack();
 
-    vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    internSelector(vm.initString);
 
     defineNative("clock", clockNative);
     defineNative("reflectField", reflectFieldNative);
+    defineNative("append", appendNative);
+    defineNative("len", lenNative);
+    defineNative("spawn", spawnNative);
+    defineNative("join", joinNative);
+    defineNative("channel", channelNative);
+    defineNative("send", sendNative);
+    defineNative("receive", receiveNative);
+    defineNative("closeChannel", closeChannelNative);
+    defineNative("fiber", fiberNative);
+    defineNative("resume", resumeNative);
+    defineNative("yield", yieldNative);
+    defineNative("isDone", isDoneNative);
+    defineNative("task", taskNative);
+    defineNative("runLoop", runLoopNative);
+    defineNative("sleep", sleepNative);
+    defineNative("open", openNative);
+    defineNative("read", readNative);
+    defineNative("write", writeNative);
+    defineNative("close", closeNative);
+    defineNative("listen", listenNative);
+    defineNative("accept", acceptNative);
+    defineNative("connect", connectNative);
+    defineNative("gcStats", gcStatsNative);
+    defineNative("substring", substringNative);
+    defineNative("indexOf", indexOfNative);
+    defineNative("charAt", charAtNative);
+    defineNative("split", splitNative);
 }
 
 void freeVM() {
+    freeEventLoop();
     freeTable(&vm.globals);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    FREE_ARRAY(ObjString*, vm.selectors, vm.selectorCapacity);
+    vm.selectors        = NULL;
+    vm.selectorCount    = 0;
+    vm.selectorCapacity = 0;
 }
 
 void push(Value value) {
@@ -126,6 +251,52 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+/*
+ * Replace the ropes among count stack slots with their strings, for code
+ * that compares strings by identity or reads their characters. The slots
+ * keep the ropes reachable while they are flattened.
+ */
+static void flattenRopes(Value* slots, int count) {
+    for (int i = 0; i < count; i++) {
+        if (IS_ROPE(slots[i])) slots[i] = OBJ_VAL(flattenRope(AS_ROPE(slots[i])));
+    }
+}
+
+static void growFrames() {
+    ObjFiber* fiber = vm.fiber;
+    int capacity    = GROW_CAPACITY(fiber->frameCapacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+
+    fiber->frames        = GROW_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity, capacity);
+    fiber->frameCapacity = capacity;
+    vm.frames            = fiber->frames;
+}
+
+/*
+ * Make room for another frame's worth of slots on the running fiber's stack.
+ * The stack may move, so every pointer into it is rebased.
+ */
+static void growStack() {
+    ObjFiber* fiber = vm.fiber;
+    int capacity    = fiber->stackCapacity;
+    while (vm.stackTop + UINT8_COUNT > vm.stack + capacity) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    Value* oldStack = vm.stack;
+    Value* stack    = GROW_ARRAY(Value, oldStack, fiber->stackCapacity, capacity);
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - oldStack);
+    }
+    vm.stackTop          = stack + (vm.stackTop - oldStack);
+    vm.stack             = stack;
+    fiber->stack         = stack;
+    fiber->stackCapacity = capacity;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
@@ -136,7 +307,12 @@ static bool call(ObjClosure* closure, int argCount) {
         runtimeError("Stack overflow");
         return false;
     }
+    if (vm.frameCount == vm.fiber->frameCapacity) growFrames();
+    if (vm.stackTop + UINT8_COUNT > vm.stack + vm.fiber->stackCapacity) growStack();
 
+#ifdef DEBUG_COUNT_OPCODES
+    countCall(closure->function);
+#endif
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure   = closure;
     frame->ip        = closure->function->chunk.bcode;
@@ -144,6 +320,11 @@ static bool call(ObjClosure* closure, int argCount) {
     return true;
 }
 
+// The class's method named name, or NULL. A name without a selector is no method's.
+static inline ObjClosure* findMethod(ObjClass* class, ObjString* name) {
+    return (unsigned) name->selector < (unsigned) class->methodCount ? class->methods[name->selector] : NULL;
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -155,9 +336,9 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* class            = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(class));
-                Value initializer;
-                if (tableGet(&class->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                ObjClosure* initializer    = findMethod(class, vm.initString);
+                if (initializer != NULL) {
+                    return call(initializer, argCount);
                 } else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got &d.", argCount);
                     return false;
@@ -167,8 +348,14 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
+                flattenRopes(vm.stackTop - argCount, argCount);
                 NativeFn native = AS_NATIVE(callee);
-                Value result    = native(argCount, vm.stackTop - argCount);
+                unsigned long switchCount = vm.switchCount;
+                Value result              = native(argCount, vm.stackTop - argCount);
+                // A native reports failure through runtimeError(), which unwinds every frame.
+                if (vm.frameCount == 0) return false;
+                // Natives that switch fibers (even back to the same one) settle both stacks themselves.
+                if (vm.switchCount != switchCount) return true;
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -182,12 +369,12 @@ static bool callValue(Value callee, int argCount) {
 }
 
 static bool invokeFromClass(ObjClass* class, ObjString* name, int argCount) {
-    Value method;
-    if (!tableGet(&class->methods, name, &method)) {
+    ObjClosure* method = findMethod(class, name);
+    if (method == NULL) {
         runtimeError("Undefined property '&s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
 }
 
 static bool invoke(ObjString* name, int argCount) {
@@ -207,14 +394,34 @@ static bool invoke(ObjString* name, int argCount) {
     return invokeFromClass(instance->class, name, argCount);
 }
 
+/*
+ * The method a super expression names. The superclass is the closure's
+ * upvalue superclass, and site the expression's slot in superMethods,
+ * where the method is kept after the first lookup.
+ */
+static ObjClosure* superMethod(ObjClosure* closure, ObjString* name, int superclass, int site) {
+    // A closure without a slot for the site still works, it just never caches.
+    bool cached        = site < closure->superMethodCount;
+    ObjClosure* method = cached ? closure->superMethods[site] : NULL;
+    if (method != NULL) return method;
+
+    method = findMethod(AS_CLASS(*closure->upvalues[superclass]->location), name);
+    if (method == NULL) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return NULL;
+    }
+    if (cached) closure->superMethods[site] = method;
+    return method;
+}
+
 static bool bindMethod(ObjClass* class, ObjString* name) {
-    Value method;
-    if (!tableGet(&class->methods, name, &method)) {
+    ObjClosure* method = findMethod(class, name);
+    if (method == NULL) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -236,6 +443,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     // else it must be a new one, in which case we create a new upvalue.
     ObjUpvalue* createdUpvalue = newUpvalue(local);
     createdUpvalue->next       = upvalue;
+    createdUpvalue->fiber      = vm.fiber;
     if (prevUpvalue == NULL) {
         vm.openUpvalues = createdUpvalue;
     } else {
@@ -249,38 +457,241 @@ static void closeUpvalues(Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed     = *upvalue->location;
         upvalue->location   = &upvalue->closed;
+        upvalue->fiber      = NULL;
         vm.openUpvalues     = upvalue->next;
     }
 }
 
+void enterFiber(ObjFiber* fiber, Value value) {
+    switchFiber(fiber);
+    if (fiber->state == FIBER_NEW) {
+        fiber->state        = FIBER_RUNNING;
+        ObjClosure* closure = AS_CLOSURE(vm.stack[0]);
+        if (closure->function->arity == 1) push(value);
+        call(closure, closure->function->arity);
+    } else {
+        fiber->state = FIBER_RUNNING;
+        push(value);
+    }
+}
+
+static Value fiberNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0])) {
+        runtimeError("fiber() expects a function.");
+        return NIL_VAL;
+    }
+    if (AS_CLOSURE(args[0])->function->arity > 1) {
+        runtimeError("A fiber's function takes at most 1 argument.");
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0]), FIBER_STACK_MIN, FIBER_FRAMES_MIN));
+}
+
+/*
+ * Transfer control to a fiber until it yields or returns. The value passed in
+ * becomes the argument of a new fiber's function, or the result of the
+ * yield() call a suspended fiber is waiting in.
+ */
+static Value resumeNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+        runtimeError("resume() expects a fiber and an optional value.");
+        return NIL_VAL;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE) {
+        runtimeError("Cannot resume a finished fiber.");
+        return NIL_VAL;
+    }
+    if (fiber->state == FIBER_RUNNING) {
+        runtimeError("Cannot resume a fiber that is already running.");
+        return NIL_VAL;
+    }
+    if (fiber->isTask) {
+        runtimeError("Cannot resume a task, the event loop runs it.");
+        return NIL_VAL;
+    }
+
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    // The resumer gets its result pushed when control comes back, so drop the
+    // call from its stack now.
+    vm.stackTop -= argCount + 1;
+    fiber->caller = vm.fiber;
+    enterFiber(fiber, value);
+    return NIL_VAL;
+}
+
+// Suspend the running fiber and hand a value back to the fiber that resumed it.
+static Value yieldNative(int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError("yield() expects at most 1 argument.");
+        return NIL_VAL;
+    }
+    if (vm.fiber == vm.mainFiber) {
+        runtimeError("Cannot yield from the main fiber.");
+        return NIL_VAL;
+    }
+
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm.stackTop -= argCount + 1;
+    if (vm.fiber->isTask) {
+        // A task yields to the other tasks; the value has nobody to go to.
+        yieldTask();
+        return NIL_VAL;
+    }
+    ObjFiber* fiber  = vm.fiber;
+    ObjFiber* caller = fiber->caller;
+    fiber->state     = FIBER_SUSPENDED;
+    fiber->caller    = NULL;
+    switchFiber(caller);
+    push(value);
+    return NIL_VAL;
+}
+
+static Value isDoneNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) {
+        runtimeError("isDone() expects a fiber.");
+        return NIL_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// Make room in a class's method array for selectors below count.
+static void growMethods(ObjClass* class, int count) {
+    ObjClosure** methods = ALLOCATE(ObjClosure*, count);
+    for (int i = 0; i < count; i++) {
+        methods[i] = i < class->methodCount ? class->methods[i] : NULL;
+    }
+
+    // A background marker may be reading the old array (see marker.h).
+    lockHeap();
+    ObjClosure** oldMethods = class->methods;
+    int oldCount            = class->methodCount;
+    class->methods          = methods;
+    class->methodCount      = count;
+    unlockHeap();
+    FREE_ARRAY(ObjClosure*, oldMethods, oldCount);
+}
+
 static void defineMethod(ObjString* name) {
-    Value method    = peek(0);
     ObjClass* class = AS_CLASS(peek(1));
-    tableSet(&class->methods, name, method);
+    // The compiler gives every method name a selector; this covers any that came by another way.
+    int selector = internSelector(name);
+    if (selector >= class->methodCount) growMethods(class, selector + 1);
+
+    if (class->methods[selector] != NULL) SHADE(OBJ_VAL(class->methods[selector]));
+    class->methods[selector] = AS_CLOSURE(peek(0));
     pop();
 }
 
+// Copy the superclass's methods down into a subclass that has none of its own yet.
+static void inheritMethods(ObjClass* subclass, ObjClass* superclass) {
+    if (superclass->methodCount == 0) return;
+    growMethods(subclass, superclass->methodCount);
+    memcpy(subclass->methods, superclass->methods, sizeof(ObjClosure*) * superclass->methodCount);
+}
+
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+static bool isText(Value value) {
+    return IS_OBJ(value) && (OBJ_TYPE(value) == OBJ_STRING || OBJ_TYPE(value) == OBJ_ROPE);
+}
 
-    int length  = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static int textLength(Value value) {
+    return IS_STRING(value) ? AS_STRING(value)->length : AS_ROPE(value)->length;
+}
 
-    ObjString* result = takeString(chars, length);
+static void concatenate() {
+    int length = textLength(peek(1)) + textLength(peek(0));
+    Obj* result;
+    if (length >= ROPE_MIN_LENGTH) {
+        result = (Obj*) newRope(AS_OBJ(peek(1)), AS_OBJ(peek(0)), length);
+    } else {
+        // Too short to be a rope, so neither half is one.
+        ObjString* b = AS_STRING(peek(0));
+        ObjString* a = AS_STRING(peek(1));
+
+        // The result is built in place, so a new string costs one allocation.
+        ObjString* string = allocateString(length);
+        memcpy(string->chars, a->chars, a->length);
+        memcpy(string->chars + a->length, b->chars, b->length);
+        result = (Obj*) finishString(string);
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
-InterpretResult interpret(const char* source) {
+/*
+ * OP_BUILD_STRING: measure every part, then write them all straight into
+ * the result, so the only allocation is the result itself.
+ */
+static void buildString(int count) {
+    Value* parts = vm.stackTop - count;
+    int length   = 0;
+    for (int i = 0; i < count; i++) {
+        length += formatValue(parts[i], NULL, 0);
+    }
+
+    ObjString* string = allocateString(length);
+    char* next        = string->chars;
+    for (int i = 0; i < count; i++) {
+        next += formatValue(parts[i], next, string->chars + length + 1 - next);
+    }
+    finishString(string);
+    vm.stackTop -= count;
+    push(OBJ_VAL(string));
+}
+
+/*
+ * OP_BUILD_LIST: the items array is filled before the list gets it, under
+ * lockHeap() since a background marker may already be reading the list.
+ * The elements stay on the stack until then.
+ */
+static void buildList(int count) {
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+    Value* items = count > 0 ? ALLOCATE(Value, count) : NULL;
+    if (count > 0) memcpy(items, vm.stackTop - count - 1, sizeof(Value) * count);
+
+    lockHeap();
+    list->items.values   = items;
+    list->items.capacity = count;
+    list->items.count    = count;
+    unlockHeap();
+    vm.stackTop -= count + 1;
+    push(OBJ_VAL(list));
+}
+
+// Check that index is the position of an element of list and store it in slot.
+static bool listIndex(ObjList* list, Value index, int* slot) {
+    if (!IS_NUMBER(index)) {
+        runtimeError("List index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    // Written so that NaN fails too.
+    if (!(number >= 0 && number < list->items.count) || number != (int) number) {
+        runtimeError("List index %g is not a position in a list of %d.", number, list->items.count);
+        return false;
+    }
+    *slot = (int) number;
+    return true;
+}
+
+_Noreturn void outOfMemory() {
+    if (vm.unwind == NULL) {
+        // Nothing is running that the error could unwind.
+        fprintf(stderr, "Out of memory.\n");
+        exit(70);
+    }
+    runtimeError("Out of memory: %zu bytes in use.", vm.bytesAllocated);
+    abandonCompiler();
+    longjmp(*vm.unwind, 1);
+}
+
+static InterpretResult compileAndRun(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
@@ -293,9 +704,53 @@ InterpretResult interpret(const char* source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
 
+    InterpretResult result = run();
+    if (result == INTERPRET_OK) pop();
+    return result;
+}
+
+InterpretResult interpret(const char* source) {
+    jmp_buf unwind;
+    jmp_buf* enclosing = vm.unwind;
+    if (setjmp(unwind) != 0) {
+        vm.unwind = enclosing;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.unwind              = &unwind;
+    InterpretResult result = compileAndRun(source);
+    vm.unwind              = enclosing;
+    return result;
+}
+
+static InterpretResult callAndRun(int argCount) {
+    Value callee = peek(argCount);
+    if (!IS_CLOSURE(callee)) {
+        runtimeError("Can only call functions and classes");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (!call(AS_CLOSURE(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
     return run();
 }
 
+/*
+ * Call the closure sitting below argCount arguments on the stack and run it
+ * to completion. On success the return value is left on the stack.
+ */
+InterpretResult interpretCall(int argCount) {
+    jmp_buf unwind;
+    jmp_buf* enclosing = vm.unwind;
+    if (setjmp(unwind) != 0) {
+        vm.unwind = enclosing;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.unwind              = &unwind;
+    InterpretResult result = callAndRun(argCount);
+    vm.unwind              = enclosing;
+    return result;
+}
+
 static InterpretResult run() {
 #include "vm_macro.h"
 
@@ -311,6 +766,12 @@ static InterpretResult run() {
         printf("\n");
         disassembleInstruction(&frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.bcode));
 #endif
+#ifdef DEBUG_COUNT_OPCODES
+        countInstruction(frame);
+#endif
+#ifdef CLOX_BENCH
+        vm.instructionCount++;
+#endif
 
         int instruction;
         switch (instruction = READ_BYTE()) {
@@ -320,6 +781,7 @@ static InterpretResult run() {
                 break;
             }
             case OP_CASE_COMP: {
+                flattenRopes(vm.stackTop - 2, 2);
                 const Value b = pop();
                 // we dont want to pop this one becuase it needs to stay on the stack for later
                 const Value a = *(vm.stackTop - 1);
@@ -380,8 +842,10 @@ static InterpretResult run() {
                 break;
             }
             case OP_SET_UPVALUE: {
-                uint8_t slot                              = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                uint8_t slot    = READ_BYTE();
+                Value* location = frame->closure->upvalues[slot]->location;
+                SHADE(*location);
+                *location = peek(0);
                 break;
             }
             case OP_GET_PROPERTY: {
@@ -419,15 +883,20 @@ static InterpretResult run() {
                 break;
             }
             case OP_GET_SUPER: {
-                ObjString* name      = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
+                ObjString* name    = READ_STRING();
+                int superclass     = READ_BYTE();
+                ObjClosure* method = superMethod(frame->closure, name, superclass, READ_BYTE());
+                if (method == NULL) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+
+                ObjBoundMethod* bound = newBoundMethod(peek(0), method);
+                pop();
+                push(OBJ_VAL(bound));
                 break;
             }
             case OP_EQUAL: {
+                flattenRopes(vm.stackTop - 2, 2);
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
@@ -445,7 +914,7 @@ static InterpretResult run() {
                 BINARY_OP(BOOL_VAL, <);
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                if (isText(peek(0)) && isText(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double a = AS_NUMBER(pop());
@@ -498,19 +967,26 @@ static InterpretResult run() {
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                // Backward jumps and calls are the safepoints where the heap can move.
+                if (compactionRequested) compactHeap();
+                if (cpuProfileTicks) sampleCpuProfile();
                 break;
             }
             case OP_CALL: {
                 int argCount = READ_BYTE();
+                // The profiler samples before calls and returns, while the caller's frame is on top.
+                if (cpuProfileTicks) sampleCpuProfile();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (compactionRequested) compactHeap();
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
             case OP_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount      = READ_BYTE();
+                if (cpuProfileTicks) sampleCpuProfile();
                 if (!invoke(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -518,17 +994,19 @@ static InterpretResult run() {
                 break;
             }
             case OP_SUPER_INVOKE: {
-                ObjString* method    = READ_STRING();
-                int argCount         = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
+                ObjString* name    = READ_STRING();
+                int argCount       = READ_BYTE();
+                int superclass     = READ_BYTE();
+                if (cpuProfileTicks) sampleCpuProfile();
+                ObjClosure* method = superMethod(frame->closure, name, superclass, READ_BYTE());
                 /*
-                We pass the superclass, method name, and argument count to our existing invokeFromClass() function.
-                That function looks up the given method on the given class and attempts to create a call to it with the given arity.
-                If a method could not be found, it returns false, and we bail out of the interpreter.
-                Otherwise, invokeFromClass() pushes a new CallFrame onto the call stack for the method’s closure.
-                That invalidates the interpreter’s cached CallFrame pointer, so we refresh frame.
+                superMethod() finds the method on the superclass the first time this closure runs the
+                instruction and remembers it after that. If a method could not be found, it returns NULL,
+                and we bail out of the interpreter. Otherwise, call() pushes a new CallFrame onto the call
+                stack for the method's closure. That invalidates the interpreter's cached CallFrame pointer,
+                so we refresh frame.
                 */
-                if (!invokeFromClass(superclass, method, argCount)) {
+                if (method == NULL || !call(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
@@ -555,16 +1033,31 @@ static InterpretResult run() {
                 break;
             }
             case OP_RETURN: {
+                if (cpuProfileTicks) sampleCpuProfile();
                 Value result = pop();
                 closeUpvalues(frame->slots);
                 vm.frameCount--;
+                vm.stackTop = frame->slots;
                 if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+                    // The outermost call leaves its result for interpret()/interpretCall().
+                    if (vm.fiber == vm.mainFiber) {
+                        push(result);
+                        return INTERPRET_OK;
+                    }
+                    // A fiber's function returned: hand the result back to its resumer.
+                    ObjFiber* fiber = vm.fiber;
+                    fiber->state    = FIBER_DONE;
+                    if (fiber->isTask) {
+                        // A finished task's result is dropped and the event loop moves on.
+                        runNextTask();
+                        frame = &vm.frames[vm.frameCount - 1];
+                        break;
+                    }
+                    switchFiber(fiber->caller);
+                    fiber->caller = NULL;
                 }
-
-                vm.stackTop = frame->slots;
                 push(result);
+
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
@@ -577,11 +1070,43 @@ static InterpretResult run() {
                     runtimeError("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                inheritMethods(AS_CLASS(peek(0)), AS_CLASS(superclass));
                 pop();
                 break;
             }
+            case OP_BUILD_STRING:
+                buildString(READ_BYTE());
+                break;
+            case OP_BUILD_LIST:
+                buildList(READ_BYTE());
+                break;
+            case OP_INDEX_GET: {
+                int slot;
+                if (!IS_LIST(peek(1))) {
+                    runtimeError("Only lists can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!listIndex(AS_LIST(peek(1)), peek(0), &slot)) return INTERPRET_RUNTIME_ERROR;
+                Value value = AS_LIST(peek(1))->items.values[slot];
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
+            case OP_INDEX_SET: {
+                int slot;
+                if (!IS_LIST(peek(2))) {
+                    runtimeError("Only lists can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!listIndex(AS_LIST(peek(2)), peek(1), &slot)) return INTERPRET_RUNTIME_ERROR;
+                Value* element = &AS_LIST(peek(2))->items.values[slot];
+                SHADE(*element);
+                *element    = peek(0);
+                Value value = pop();
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
             case OP_METHOD:
                 defineMethod(READ_STRING());
                 break;
@@ -5,6 +5,8 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
@@ -12,35 +14,48 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+// Fibers other than the main one start this small and grow as they call deeper.
+#define FIBER_STACK_MIN (UINT8_COUNT * 2)
+#define FIBER_FRAMES_MIN 4
+
 /*
- * CallFrame represents an ongoing function call.
- *
- * function: pointer to the currently executing function
- * ip: instruction pointer into the next bytecode instruction
- * slots: pointer into the VM's Value stack
+ * frames, frameCount, stack, stackTop and openUpvalues are the registers of
+ * the running fiber. Switching fibers saves them into the old ObjFiber and
+ * loads them from the new one. switchCount goes up on every switch, which is
+ * how a call can tell that a native handed control to another fiber.
  *
+ * unwind is where an allocation that cannot be satisfied jumps to: the
+ * interpret() or interpretCall() that is running, if any (see outOfMemory()).
  */
 typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip;
-    Value* slots;
-} CallFrame;
-
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    ObjFiber* fiber;
+    ObjFiber* mainFiber;
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
     Table globals;
     Table strings;
     ObjString* initString;
+    // Every string given a selector, indexed by it.
+    ObjString** selectors;
+    int selectorCount;
+    int selectorCapacity;
     ObjUpvalue* openUpvalues;
+    unsigned long switchCount;
+    jmp_buf* unwind;
     size_t bytesAllocated;
     size_t nextGC;
     Obj* objects;
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+#ifdef CLOX_BENCH
+    // Includes the isolates this VM has joined, and the ones they joined.
+    unsigned long instructionCount;
+    // The peak heaps of those isolates, added up; gcStats has this VM's own.
+    size_t isolatePeakHeap;
+#endif
 } VM;
 
 typedef enum {
@@ -49,11 +64,20 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// Every thread runs its own VM (see isolate.h), so the VM is thread local.
+extern _Thread_local VM vm;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretCall(int argCount);
+void runtimeError(const char* format, ...);
+// Report that the heap is out of room and unwind to the running interpret() or interpretCall().
+_Noreturn void outOfMemory();
+void switchFiber(ObjFiber* fiber);
+// Switch to a fiber and hand it a value: a new fiber's function is called with
+// it, a suspended fiber gets it as the result of the call it is waiting in.
+void enterFiber(ObjFiber* fiber, Value value);
 static InterpretResult run();
 void push(Value value);
 Value pop();